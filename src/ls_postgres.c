@@ -6,6 +6,7 @@
 */
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,6 +23,21 @@
 #define LUASQL_ENVIRONMENT_PG "PostgreSQL environment"
 #define LUASQL_CONNECTION_PG "PostgreSQL connection"
 #define LUASQL_CURSOR_PG "PostgreSQL cursor"
+#define LUASQL_STATEMENT_PG "PostgreSQL statement"
+#define LUASQL_BLOBVALUE_PG "PostgreSQL blob value"
+#define LUASQL_PIPELINE_PG "PostgreSQL pipeline"
+
+/* OIDs of the built-in types of bound parameters (see pg_type.dat) */
+#define BOOLOID   16
+#define BYTEAOID  17
+#define INT8OID   20
+#define FLOAT8OID 701
+
+#if LUA_VERSION_NUM >= 502
+#define luasql_rawlen lua_rawlen
+#else
+#define luasql_rawlen lua_objlen
+#endif
 
 typedef struct {
 	short      closed;
@@ -32,22 +48,73 @@ typedef struct {
 	short      closed;
 	int        env;                /* reference to environment */
 	int        auto_commit;        /* 0 for manual commit */
+	int        typenames;          /* reference to OID -> type name table */
+	int        typenames_pid;      /* server process the table belongs to */
+	short      streaming;          /* a streaming cursor is reading results */
+	short      pipeline;           /* the connection is in pipeline mode */
+	unsigned int stmt_counter;     /* number of statements prepared */
 	PGconn    *pg_conn;
 } conn_data;
 
 
+typedef struct {
+	short      closed;
+	int        conn;               /* reference to connection */
+	conn_data *conn_data;          /* connection of the statement */
+	PGresult  *desc;               /* description of the statement */
+	char       name[32];           /* name of the prepared statement */
+} stmt_data;
+
+
 typedef struct {
 	short      closed;
 	int        conn;               /* reference to connection */
 	int        numcols;            /* number of columns */
 	int        colnames, coltypes; /* reference to column information tables */
 	int        curr_tuple;         /* next tuple to be read */
+	conn_data *stream;             /* connection streaming the rows, if any */
 	PGresult  *pg_res;
 } cur_data;
 
 
+#ifdef LIBPQ_HAS_PIPELINING
+/* Statements sent to the server without waiting for their results */
+typedef struct {
+	short      closed;
+	int        conn;               /* reference to connection */
+	conn_data *conn_data;          /* connection of the pipeline */
+	int        queued;             /* statements sent since the last flush */
+} pipeline_data;
+#endif
+
+
+/* String to be bound as a bytea */
+typedef struct {
+	short      closed;
+	int        ref;                /* reference to the string */
+	const char *data;
+	size_t     len;
+} blobvalue_data;
+
+
+/* Parameters of a statement, in the layout expected by libpq */
+typedef struct {
+	int          n;                /* number of parameters */
+	Oid         *types;
+	const char **values;
+	int         *lengths;
+	int         *formats;
+} params_data;
+
+/* Bytes needed by each parameter */
+#define PARAM_SIZE (sizeof (Oid) + sizeof (char *) + 2 * sizeof (int))
+
+
 typedef void (*creator) (lua_State *L, cur_data *cur);
 
+/* Gets the type of a column or parameter of a result (PQftype or PQparamtype) */
+typedef Oid (*typegetter) (const PGresult *res, int i);
+
 
 /*
 ** Check for valid environment.
@@ -82,6 +149,105 @@ static cur_data *getcursor (lua_State *L) {
 }
 
 
+/*
+** Return why the connection cannot run a statement now, or NULL if it
+** can.
+*/
+static const char *conn_busy (conn_data *conn) {
+	if (conn->streaming)
+		return "connection is streaming a query";
+	if (conn->pipeline)
+		return "connection is in pipeline mode";
+	return NULL;
+}
+
+
+/*
+** Raise an error if the connection cannot run a statement now.
+*/
+static void checkidle (lua_State *L, conn_data *conn) {
+	const char *busy = conn_busy (conn);
+	if (busy != NULL)
+		luaL_argerror (L, 1, lua_pushfstring (L, LUASQL_PREFIX"%s", busy));
+}
+
+
+/*
+** Check for a connection that is not busy streaming the rows of a query
+** or running a pipeline.
+*/
+static conn_data *getidleconnection (lua_State *L) {
+	conn_data *conn = getconnection (L);
+	checkidle (L, conn);
+	return conn;
+}
+
+
+/*
+** Discard the remaining results of the query of the connection.
+*/
+static void conn_drain (conn_data *conn) {
+	PGresult *res;
+	while ((res = PQgetResult (conn->pg_conn)) != NULL)
+		PQclear (res);
+	conn->streaming = 0;
+}
+
+
+/*
+** Stop the query of a streaming cursor which was not read to its end.
+** In auto commit mode the query is cancelled; inside a transaction,
+** which a cancelled query would abort, the remaining rows are read and
+** discarded.
+*/
+static void stream_stop (cur_data *cur) {
+	conn_data *conn = cur->stream;
+	cur->stream = NULL;
+	if (conn == NULL || conn->closed || !conn->streaming)
+		return;
+	if (conn->auto_commit) {
+		PGcancel *cancel = PQgetCancel (conn->pg_conn);
+		if (cancel != NULL) {
+			char errbuf[256];
+			PQcancel (cancel, errbuf, sizeof (errbuf));
+			PQfreeCancel (cancel);
+		}
+	}
+	conn_drain (conn);
+}
+
+
+/*
+** Replace the result of a streaming cursor by the next chunk of rows.
+** Return the status of the new result: PGRES_SINGLE_TUPLE (or
+** PGRES_TUPLES_CHUNK) when there are rows, PGRES_TUPLES_OK at the end
+** of the result set, or an error status. The remaining results are
+** discarded in the last two cases.
+*/
+static ExecStatusType stream_next (cur_data *cur) {
+	conn_data *conn = cur->stream;
+	PGresult *res = PQgetResult (conn->pg_conn);
+	ExecStatusType status = PQresultStatus (res);
+
+	if (res == NULL)
+		status = PGRES_TUPLES_OK;
+	else {
+		PQclear (cur->pg_res);
+		cur->pg_res = res;
+		cur->curr_tuple = 0;
+	}
+	if (status != PGRES_SINGLE_TUPLE
+#ifdef LIBPQ_HAS_CHUNK_MODE
+			&& status != PGRES_TUPLES_CHUNK
+#endif
+			) {
+		conn_drain (conn);
+		cur->stream = NULL;
+	}
+	return status;
+}
+
+
 /*
 ** Push the value of #i field of #tuple row.
 */
@@ -99,6 +265,7 @@ static void pushvalue (lua_State *L, PGresult *res, int tuple, int i) {
 static void cur_nullify (lua_State *L, cur_data *cur) {
 	/* Nullify structure fields. */
 	cur->closed = 1;
+	stream_stop (cur);
 	PQclear(cur->pg_res);
 	luaL_unref (L, LUA_REGISTRYINDEX, cur->conn);
 	luaL_unref (L, LUA_REGISTRYINDEX, cur->colnames);
@@ -111,9 +278,23 @@ static void cur_nullify (lua_State *L, cur_data *cur) {
 */
 static int cur_fetch (lua_State *L) {
 	cur_data *cur = getcursor (L);
-	PGresult *res = cur->pg_res;
-	int tuple = cur->curr_tuple;
-
+	PGresult *res;
+	int tuple;
+
+	if (cur->curr_tuple >= PQntuples(cur->pg_res) && cur->stream != NULL) {
+		/* read the next chunk of a streaming cursor */
+		ExecStatusType status;
+		luaL_argcheck (L, !cur->stream->closed, 1, LUASQL_PREFIX"connection is closed");
+		status = stream_next (cur);
+		if (status != PGRES_TUPLES_OK && PQntuples (cur->pg_res) == 0) {
+			int ret = luasql_failmsg (L, "error fetching result. PostgreSQL: ",
+					PQresultErrorMessage (cur->pg_res));
+			cur_nullify (L, cur);
+			return ret;
+		}
+	}
+	res = cur->pg_res;
+	tuple = cur->curr_tuple;
 	if (tuple >= PQntuples(cur->pg_res)) {
 		cur_nullify (L, cur);
 		lua_pushnil(L);  /* no more results */
@@ -182,29 +363,112 @@ static int cur_close (lua_State *L) {
 
 
 /*
-** Get the internal database type of the given column.
+** Push the type name cached for OID 'oid' in the table at index 't':
+** a string, false if the type is unknown, or nil if not cached.
 */
-static char *getcolumntype (PGconn *conn, PGresult *result, int i, char *buff) {
-	Oid codigo = PQftype (result, i);
-	char stmt[100];
-	PGresult *res;
+static void pushtypename (lua_State *L, int t, Oid oid) {
+	lua_pushnumber (L, (lua_Number)oid);
+	lua_rawget (L, t);
+}
 
-	sprintf (stmt, "select typname from pg_type where oid = %d", codigo);
-	res = PQexec(conn, stmt);
-	strcpy (buff, "undefined");
 
-	if (PQresultStatus (res) == PGRES_TUPLES_OK) {
-		if (PQntuples(res) > 0) {
-			char *name = PQgetvalue(res, 0, 0);
-			if (strcmp (name, "bpchar")==0 || strcmp (name, "varchar")==0) {
-				int modifier = PQfmod (result, i) - 4;
-				sprintf (buff, "%.20s (%d)", name, modifier);
+/*
+** Push the table of type names of the connection, indexed by OID.
+** The names of the 'n' types of 'result' given by 'gettype' that are
+** missing from it are loaded with a single query to pg_type.
+** The table is discarded when the connection is to another server
+** process, since OIDs of user types are local to a database.
+** No query is run while the connection is busy streaming the rows of
+** another one or running a pipeline: missing types are then left out of
+** the table.
+*/
+static void pushtypenames (lua_State *L, conn_data *conn, const PGresult *result,
+		int n, typegetter gettype) {
+	int pid = PQbackendPID (conn->pg_conn);
+	int missing = 0;
+	int t, i;
+
+	if (conn->typenames == LUA_NOREF || conn->typenames_pid != pid) {
+		luaL_unref (L, LUA_REGISTRYINDEX, conn->typenames);
+		lua_newtable (L);
+		conn->typenames = luaL_ref (L, LUA_REGISTRYINDEX);
+		conn->typenames_pid = pid;
+	}
+	lua_rawgeti (L, LUA_REGISTRYINDEX, conn->typenames);
+	t = lua_gettop (L);
+
+	/* build the list of OIDs not in the table, marking them as unknown */
+	luaL_checkstack (L, n + 2, LUASQL_PREFIX"too many columns");
+	lua_pushliteral (L, "select oid, typname from pg_type where oid in (0");
+	for (i = 0; i < n; i++) {
+		Oid oid = gettype (result, i);
+		char buff[16];
+		pushtypename (L, t, oid);
+		if (lua_isnil (L, -1) && conn_busy (conn) == NULL) {
+			lua_pop (L, 1);
+			lua_pushnumber (L, (lua_Number)oid);
+			lua_pushboolean (L, 0);
+			lua_rawset (L, t);
+			sprintf (buff, ",%u", oid);
+			lua_pushstring (L, buff);
+			missing++;
+		}
+		else
+			lua_pop (L, 1);
+	}
+
+	if (missing == 0)
+		lua_pop (L, 1);
+	else {
+		PGresult *res;
+		lua_pushliteral (L, ")");
+		lua_concat (L, missing + 2);
+		res = PQexec (conn->pg_conn, lua_tostring (L, -1));
+		lua_pop (L, 1);
+		if (PQresultStatus (res) == PGRES_TUPLES_OK) {
+			for (i = 0; i < PQntuples (res); i++) {
+				lua_pushnumber (L, (lua_Number)strtoul (PQgetvalue (res, i, 0), NULL, 10));
+				lua_pushstring (L, PQgetvalue (res, i, 1));
+				lua_rawset (L, t);
+			}
+		}
+		else {
+			/* the query failed: try again next time */
+			for (i = 0; i < n; i++) {
+				Oid oid = gettype (result, i);
+				pushtypename (L, t, oid);
+				if (lua_isboolean (L, -1)) {
+					lua_pushnumber (L, (lua_Number)oid);
+					lua_pushnil (L);
+					lua_rawset (L, t);
+				}
+				lua_pop (L, 1);
 			}
-			else
-				strncpy (buff, name, 20);
 		}
+		PQclear (res);
 	}
-	PQclear(res);
+}
+
+
+/*
+** Get the internal database type of the given column, looking it up
+** in the table of type names at index 't'.
+*/
+static char *getcolumntype (lua_State *L, int t, PGresult *result, int i, char *buff) {
+	strcpy (buff, "undefined");
+	pushtypename (L, t, PQftype (result, i));
+	if (lua_isstring (L, -1)) {
+		const char *name = lua_tostring (L, -1);
+		if (strcmp (name, "bpchar")==0 || strcmp (name, "varchar")==0) {
+			int modifier = PQfmod (result, i) - 4;
+			sprintf (buff, "%.20s (%d)", name, modifier);
+		}
+		else {
+			strncpy (buff, name, 20);
+			buff[20] = '\0';
+		}
+	}
+	lua_pop (L, 1);
 	return buff;
 }
 
@@ -230,14 +494,16 @@ static void create_coltypes (lua_State *L, cur_data *cur) {
 	PGresult *result = cur->pg_res;
 	conn_data *conn;
 	char typename[100];
-	int i;
+	int i, t;
 	lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
 	if (!lua_isuserdata (L, -1))
 		luaL_error (L, LUASQL_PREFIX"invalid connection");
 	conn = (conn_data *)lua_touserdata (L, -1);
+	pushtypenames (L, conn, result, cur->numcols, PQftype);
+	t = lua_gettop (L);
 	lua_newtable (L);
 	for (i = 1; i <= cur->numcols; i++) {
-		lua_pushstring(L, getcolumntype (conn->pg_conn, result, i-1, typename));
+		lua_pushstring(L, getcolumntype (L, t, result, i-1, typename));
 		lua_rawseti (L, -2, i);
 	}
 }
@@ -284,7 +550,10 @@ static int cur_getcoltypes (lua_State *L) {
 ** Push the number of rows.
 */
 static int cur_numrows (lua_State *L) {
-	lua_pushnumber (L, PQntuples (getcursor(L)->pg_res));
+	cur_data *cur = getcursor (L);
+	if (cur->stream != NULL)
+		return luasql_faildirect (L, "the number of rows of a streaming cursor is unknown");
+	lua_pushnumber (L, PQntuples (cur->pg_res));
 	return 1;
 }
 
@@ -303,6 +572,7 @@ static int create_cursor (lua_State *L, int conn, PGresult *result) {
 	cur->colnames = LUA_NOREF;
 	cur->coltypes = LUA_NOREF;
 	cur->curr_tuple = 0;
+	cur->stream = NULL;
 	cur->pg_res = result;
 	lua_pushvalue (L, conn);
 	cur->conn = luaL_ref (L, LUA_REGISTRYINDEX);
@@ -335,6 +605,7 @@ static int conn_gc (lua_State *L) {
 		/* Nullify structure fields. */
 		conn->closed = 1;
 		luaL_unref (L, LUA_REGISTRYINDEX, conn->env);
+		luaL_unref (L, LUA_REGISTRYINDEX, conn->typenames);
 		PQfinish (conn->pg_conn);
 	}
 	return 0;
@@ -343,8 +614,8 @@ static int conn_gc (lua_State *L) {
 
 /*
 ** Closes the connection on top of the stack.
-** Returns true in case of success, or false in case the connection was
-** already closed.
+** Returns true in case of success, or false and a message in case the
+** connection was already closed or is in pipeline mode.
 ** Throws an error if the argument is not a connection.
 */
 static int conn_close (lua_State *L) {
@@ -355,8 +626,14 @@ static int conn_close (lua_State *L) {
 		lua_pushstring(L, "Connection is already closed");
 		return 2;
 	}
+	if (conn->pipeline) {
+		lua_pushboolean (L, 0);
+		lua_pushstring(L, conn_busy (conn));
+		return 2;
+	}
 	conn->closed = 1;
 	luaL_unref (L, LUA_REGISTRYINDEX, conn->env);
+	luaL_unref (L, LUA_REGISTRYINDEX, conn->typenames);
 	PQfinish (conn->pg_conn);
 
 	lua_pushboolean (L, 1);
@@ -408,14 +685,146 @@ static int conn_escape (lua_State *L) {
 
 
 /*
-** Execute an SQL statement.
-** Return a Cursor object if the statement is a query, otherwise
-** return the number of tuples affected by the statement.
+** Return the blob value at stack index 'idx', or NULL if it is not one.
 */
-static int conn_execute (lua_State *L) {
-	conn_data *conn = getconnection (L);
-	const char *statement = luaL_checkstring (L, 2);
-	PGresult *res = PQexec(conn->pg_conn, statement);
+static blobvalue_data *toblobvalue (lua_State *L, int idx) {
+	void *p = lua_touserdata (L, idx);
+	int same = 0;
+	if (p != NULL && lua_getmetatable (L, idx)) {
+		luaL_getmetatable (L, LUASQL_BLOBVALUE_PG);
+		same = lua_rawequal (L, -1, -2);
+		lua_pop (L, 2);
+	}
+	return same ? (blobvalue_data *)p : NULL;
+}
+
+
+/*
+** Set parameter #i from the value at stack index 'idx'.
+** Numbers are converted to strings pushed on the stack, so they must
+** stay there until the statement is executed. Strings containing a
+** zero byte and blob values are sent as binary bytea values; other
+** strings are left for the server to type.
+*/
+static void setparam (lua_State *L, params_data *p, int i, int idx) {
+	char buff[64];
+	p->types[i] = 0;
+	p->values[i] = NULL;
+	p->lengths[i] = 0;
+	p->formats[i] = 0;
+	switch (lua_type (L, idx)) {
+		case LUA_TNIL:
+			break;
+		case LUA_TBOOLEAN:
+			p->types[i] = BOOLOID;
+			p->values[i] = lua_toboolean (L, idx) ? "t" : "f";
+			break;
+		case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+			if (lua_isinteger (L, idx)) {
+				p->types[i] = INT8OID;
+				sprintf (buff, "%lld", (long long)lua_tointeger (L, idx));
+			}
+			else
+#else
+			if (lua_tonumber (L, idx) >= -9007199254740992.0 &&
+					lua_tonumber (L, idx) <= 9007199254740992.0 &&
+					lua_tonumber (L, idx) == (double)(long long)lua_tonumber (L, idx)) {
+				/* integral values, which are exact up to 2^53 */
+				p->types[i] = INT8OID;
+				sprintf (buff, "%.0f", (double)lua_tonumber (L, idx));
+			}
+			else
+#endif
+			{
+				p->types[i] = FLOAT8OID;
+				sprintf (buff, "%.17g", (double)lua_tonumber (L, idx));
+			}
+			lua_pushstring (L, buff);
+			p->values[i] = lua_tostring (L, -1);
+			break;
+		case LUA_TSTRING: {
+			size_t len;
+			const char *str = lua_tolstring (L, idx, &len);
+			p->values[i] = str;
+			p->lengths[i] = (int)len;
+			if (memchr (str, '\0', len) != NULL) {
+				p->types[i] = BYTEAOID;
+				p->formats[i] = 1;
+			}
+			break;
+		}
+		case LUA_TUSERDATA: {
+			blobvalue_data *blob = toblobvalue (L, idx);
+			if (blob != NULL) {
+				p->types[i] = BYTEAOID;
+				p->values[i] = blob->data;
+				p->lengths[i] = (int)blob->len;
+				p->formats[i] = 1;
+				break;
+			}
+		}
+		/* FALLTHROUGH */
+		default:
+			luaL_error (L, LUASQL_PREFIX"unhandled data type %s in parameter binding",
+				lua_typename (L, lua_type (L, idx)));
+	}
+}
+
+
+/*
+** Read the parameters found from stack index 'arg' on: either one
+** table, with the values at indices 1 to its field 'n' or its length,
+** or positional values.
+** The arrays are allocated in a userdata left on the stack, together
+** with the values converted to strings.
+*/
+static void readparams (lua_State *L, int arg, params_data *p) {
+	int top = lua_gettop (L);
+	int table = (top == arg && lua_type (L, arg) == LUA_TTABLE);
+	char *mem;
+	int i;
+
+	if (top < arg)
+		p->n = 0;
+	else if (table) {
+		lua_Number n;
+		lua_getfield (L, arg, "n");
+		n = lua_isnumber (L, -1) ? lua_tonumber (L, -1)
+			: (lua_Number)luasql_rawlen (L, arg);
+		lua_pop (L, 1);
+		luaL_argcheck (L, n >= 0 && n <= INT_MAX / PARAM_SIZE, arg,
+			LUASQL_PREFIX"invalid number of parameters");
+		p->n = (int)n;
+	}
+	else
+		p->n = top - arg + 1;
+
+	mem = (char *)LUASQL_NEWUD (L, p->n * PARAM_SIZE);
+	p->values = (const char **)mem;
+	p->types = (Oid *)(p->values + p->n);
+	p->lengths = (int *)(p->types + p->n);
+	p->formats = p->lengths + p->n;
+
+	luaL_checkstack (L, 2 * p->n, LUASQL_PREFIX"too many parameters");
+	for (i = 0; i < p->n; i++) {
+		if (table) {
+			lua_rawgeti (L, arg, i + 1);
+			setparam (L, p, i, lua_gettop (L));
+		}
+		else
+			setparam (L, p, i, arg + i);
+	}
+}
+
+
+/*
+** Push the outcome of the execution of a statement: a Cursor object if
+** the statement is a query, the number of tuples affected by it
+** otherwise, or nil and an error message.
+** 'o' is the stack index of the connection.
+*/
+static int pushresult (lua_State *L, int o, conn_data *conn, PGresult *res) {
 	if (res && PQresultStatus(res)==PGRES_COMMAND_OK) {
 		/* no tuples returned */
 		lua_pushnumber(L, atof(PQcmdTuples(res)));
@@ -424,7 +833,7 @@ static int conn_execute (lua_State *L) {
 	}
 	else if (res && PQresultStatus(res)==PGRES_TUPLES_OK)
 		/* tuples returned */
-		return create_cursor (L, 1, res);
+		return create_cursor (L, o, res);
 	else {
 		/* error */
 		PQclear (res);
@@ -433,11 +842,475 @@ static int conn_execute (lua_State *L) {
 }
 
 
+/*
+** Execute an SQL statement.
+** The values from stack index 3 on are bound to its parameters ($1,
+** $2, ...), given positionally or in a table.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int conn_execute (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	params_data params;
+	PGresult *res;
+
+	readparams (L, 3, &params);
+	if (params.n == 0)
+		/* may run several statements */
+		res = PQexec(conn->pg_conn, statement);
+	else
+		res = PQexecParams(conn->pg_conn, statement, params.n, params.types,
+			params.values, params.lengths, params.formats, 0);
+	return pushresult (L, 1, conn, res);
+}
+
+
+/*
+** Execute an SQL statement, streaming the rows of a query.
+** The rows are read from the server as the cursor is fetched, in chunks
+** of the given number of rows (one by one if libpq does not support
+** chunks), instead of all at once.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int conn_executestream (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	int rows = (int)luaL_optnumber (L, 3, 1);
+	PGresult *res;
+	int ret;
+
+	luaL_argcheck (L, rows > 0, 3, LUASQL_PREFIX"invalid number of rows");
+	if (!PQsendQuery (conn->pg_conn, statement))
+		return luasql_failmsg(L, "error executing statement. PostgreSQL: ", PQerrorMessage(conn->pg_conn));
+#ifdef LIBPQ_HAS_CHUNK_MODE
+	if (rows > 1)
+		PQsetChunkedRowsMode (conn->pg_conn, rows);
+	else
+#endif
+	PQsetSingleRowMode (conn->pg_conn);
+
+	res = PQgetResult (conn->pg_conn);
+	switch (PQresultStatus (res)) {
+		case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+		case PGRES_TUPLES_CHUNK:
+#endif
+			/* first rows of a query */
+			conn->streaming = 1;
+			create_cursor (L, 1, res);
+			((cur_data *)lua_touserdata (L, -1))->stream = conn;
+			return 1;
+		case PGRES_TUPLES_OK:
+			/* query without rows */
+			conn_drain (conn);
+			return create_cursor (L, 1, res);
+		case PGRES_COMMAND_OK:
+			/* no tuples returned */
+			conn_drain (conn);
+			lua_pushnumber(L, atof(PQcmdTuples(res)));
+			PQclear (res);
+			return 1;
+		default:
+			/* error */
+			conn_drain (conn);
+			ret = luasql_failmsg(L, "error executing statement. PostgreSQL: ",
+					res ? PQresultErrorMessage(res) : PQerrorMessage(conn->pg_conn));
+			PQclear (res);
+			return ret;
+	}
+}
+
+
+/*
+** Check for valid statement.
+*/
+static stmt_data *getstatement (lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_PG);
+	luaL_argcheck (L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+	luaL_argcheck (L, !stmt->closed, 1, LUASQL_PREFIX"statement is closed");
+	luaL_argcheck (L, !stmt->conn_data->closed, 1, LUASQL_PREFIX"connection is closed");
+	checkidle (L, stmt->conn_data);
+	return stmt;
+}
+
+
+/*
+** Prepare an SQL statement on the server, so that it is parsed and
+** planned only once.
+** Return a Statement object, or nil and an error message.
+*/
+static int conn_prepare (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	const char *statement = luaL_checkstring (L, 2);
+	char name[32];
+	PGresult *res;
+	stmt_data *stmt;
+
+	sprintf (name, "luasql_%u", ++conn->stmt_counter);
+	res = PQprepare (conn->pg_conn, name, statement, 0, NULL);
+	if (PQresultStatus (res) != PGRES_COMMAND_OK) {
+		PQclear (res);
+		return luasql_failmsg(L, "error preparing statement. PostgreSQL: ", PQerrorMessage(conn->pg_conn));
+	}
+	PQclear (res);
+	res = PQdescribePrepared (conn->pg_conn, name);
+	if (PQresultStatus (res) != PGRES_COMMAND_OK) {
+		int ret = luasql_failmsg(L, "error describing statement. PostgreSQL: ", PQerrorMessage(conn->pg_conn));
+		char sql[48];
+		PQclear (res);
+		sprintf (sql, "DEALLOCATE %s", name);
+		PQclear (PQexec (conn->pg_conn, sql));
+		return ret;
+	}
+
+	stmt = (stmt_data *)LUASQL_NEWUD (L, sizeof (stmt_data));
+	luasql_setmeta (L, LUASQL_STATEMENT_PG);
+
+	/* fill in structure */
+	stmt->closed = 0;
+	stmt->conn_data = conn;
+	stmt->desc = res;
+	strcpy (stmt->name, name);
+	lua_pushvalue (L, 1);
+	stmt->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+	return 1;
+}
+
+
+/*
+** Release the prepared statement on the server.
+** Return 0 in case of success, or push nil and an error message and
+** return 2 in case the server could not release it.
+*/
+static int stmt_deallocate (lua_State *L, stmt_data *stmt) {
+	conn_data *conn = stmt->conn_data;
+	int ret = 0;
+	stmt->closed = 1;
+	if (!conn->closed && conn_busy (conn) == NULL) {
+		PGresult *res;
+#ifdef LIBPQ_HAS_CLOSE_PREPARED
+		res = PQclosePrepared (conn->pg_conn, stmt->name);
+#else
+		char sql[48];
+		sprintf (sql, "DEALLOCATE %s", stmt->name);
+		res = PQexec (conn->pg_conn, sql);
+#endif
+		if (PQresultStatus (res) != PGRES_COMMAND_OK)
+			ret = -1;
+		PQclear (res);
+	}
+	PQclear (stmt->desc);
+	luaL_unref (L, LUA_REGISTRYINDEX, stmt->conn);
+	if (ret != 0)
+		ret = luasql_failmsg(L, "error deallocating statement. PostgreSQL: ", PQerrorMessage(conn->pg_conn));
+	return ret;
+}
+
+
+/*
+** Execute a prepared statement, binding its parameters to the given
+** values, given positionally or in a table as in conn:execute.
+** Parameters of type bytea receive strings as binary values; other
+** values keep the text format.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int stmt_execute (lua_State *L) {
+	stmt_data *stmt = getstatement (L);
+	params_data params;
+	PGresult *res;
+	int i;
+
+	readparams (L, 2, &params);
+	if (params.n != PQnparams (stmt->desc))
+		return luaL_error (L, LUASQL_PREFIX"wrong number of parameters: expected=%d, given=%d",
+			PQnparams (stmt->desc), params.n);
+	for (i = 0; i < params.n; i++)
+		/* untyped parameters are the plain strings */
+		if (PQparamtype (stmt->desc, i) == BYTEAOID && params.values[i] != NULL
+				&& params.types[i] == 0)
+			params.formats[i] = 1;
+	res = PQexecPrepared (stmt->conn_data->pg_conn, stmt->name, params.n,
+		params.values, params.lengths, params.formats, 0);
+	lua_rawgeti (L, LUA_REGISTRYINDEX, stmt->conn);
+	return pushresult (L, lua_gettop (L), stmt->conn_data, res);
+}
+
+
+/*
+** Return the list of parameter types of a prepared statement.
+*/
+static int stmt_getparamtypes (lua_State *L) {
+	stmt_data *stmt = getstatement (L);
+	int n = PQnparams (stmt->desc);
+	int i, t;
+
+	pushtypenames (L, stmt->conn_data, stmt->desc, n, PQparamtype);
+	t = lua_gettop (L);
+	lua_newtable (L);
+	for (i = 0; i < n; i++) {
+		pushtypename (L, t, PQparamtype (stmt->desc, i));
+		if (!lua_isstring (L, -1)) {
+			lua_pop (L, 1);
+			lua_pushliteral (L, "undefined");
+		}
+		lua_rawseti (L, -2, i + 1);
+	}
+	return 1;
+}
+
+
+/*
+** Statement object collector function
+*/
+static int stmt_gc (lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_PG);
+	if (stmt != NULL && !(stmt->closed))
+		stmt_deallocate (L, stmt);  /* ignore errors while collecting */
+	return 0;
+}
+
+
+/*
+** Closes the statement on top of the stack, releasing it on the server.
+** Returns true in case of success, false and a message in case the
+** statement was already closed or its connection is busy, or nil and an
+** error message in case the server could not release it; the statement
+** is closed anyway.
+*/
+static int stmt_close (lua_State *L) {
+	stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_PG);
+	luaL_argcheck (L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+	if (stmt->closed) {
+		lua_pushboolean (L, 0);
+		lua_pushstring (L, "statement is already closed");
+		return 2;
+	}
+	if (!stmt->conn_data->closed && conn_busy (stmt->conn_data) != NULL) {
+		lua_pushboolean (L, 0);
+		lua_pushstring (L, conn_busy (stmt->conn_data));
+		return 2;
+	}
+	if (stmt_deallocate (L, stmt) != 0)
+		return 2;
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+#ifdef LIBPQ_HAS_PIPELINING
+/*
+** Check for valid pipeline.
+*/
+static pipeline_data *getpipeline (lua_State *L) {
+	pipeline_data *p = (pipeline_data *)luaL_checkudata (L, 1, LUASQL_PIPELINE_PG);
+	luaL_argcheck (L, p != NULL, 1, LUASQL_PREFIX"pipeline expected");
+	luaL_argcheck (L, !p->closed, 1, LUASQL_PREFIX"pipeline is closed");
+	luaL_argcheck (L, !p->conn_data->closed, 1, LUASQL_PREFIX"connection is closed");
+	return p;
+}
+
+
+/*
+** Send an SQL statement through the pipeline, binding its parameters
+** to the given values as conn:execute does.
+** Return true, or nil and an error message.
+*/
+static int pipeline_execute (lua_State *L) {
+	pipeline_data *p = getpipeline (L);
+	const char *statement = luaL_checkstring (L, 2);
+	params_data params;
+
+	readparams (L, 3, &params);
+	if (!PQsendQueryParams (p->conn_data->pg_conn, statement, params.n, params.types,
+			params.values, params.lengths, params.formats, 0))
+		return luasql_failmsg(L, "error executing statement. PostgreSQL: ", PQerrorMessage(p->conn_data->pg_conn));
+	p->queued++;
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Mark the end of the statements sent through the pipeline and read
+** their results.
+** If 'keep' is true, push a table with the result of each statement in
+** order: a Cursor object, the number of tuples affected, or false if
+** it failed; and if any failed, a table with their error messages at
+** the same indices. Otherwise, discard the results.
+** Return the number of values pushed.
+*/
+static int pipeline_sync (lua_State *L, pipeline_data *p, int keep) {
+	PGconn *pg_conn = p->conn_data->pg_conn;
+	int results = 0, errors = 0, conn = 0;
+	int queued = p->queued;
+	PGresult *res;
+	int i;
+
+	p->queued = 0;
+	if (!PQpipelineSync (pg_conn)) {
+		if (keep)
+			return luasql_failmsg(L, "error flushing pipeline. PostgreSQL: ", PQerrorMessage(pg_conn));
+		return 0;
+	}
+	if (keep) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, p->conn);
+		conn = lua_gettop (L);
+		lua_createtable (L, queued, 0);
+		results = lua_gettop (L);
+	}
+	for (i = 1; i <= queued; i++) {
+		/* each statement gives one result, followed by NULL */
+		res = PQgetResult (pg_conn);
+		if (keep) {
+			switch (PQresultStatus (res)) {
+				case PGRES_TUPLES_OK:
+					create_cursor (L, conn, res);
+					res = NULL;
+					break;
+				case PGRES_COMMAND_OK:
+					lua_pushnumber (L, atof (PQcmdTuples (res)));
+					break;
+				default:
+					if (errors == 0) {
+						/* the table of messages goes above the results */
+						lua_newtable (L);
+						errors = lua_gettop (L);
+					}
+					if (PQresultStatus (res) == PGRES_PIPELINE_ABORTED)
+						lua_pushliteral (L, LUASQL_PREFIX"statement skipped after an error in the pipeline");
+					else
+						lua_pushstring (L, PQresultErrorMessage (res));
+					lua_rawseti (L, errors, i);
+					lua_pushboolean (L, 0);
+			}
+			lua_rawseti (L, results, i);
+		}
+		PQclear (res);
+		while ((res = PQgetResult (pg_conn)) != NULL)
+			PQclear (res);
+	}
+	/* the result of the synchronization point */
+	PQclear (PQgetResult (pg_conn));
+	return keep ? (errors ? 2 : 1) : 0;
+}
+
+
+/*
+** Read the results of the statements sent since the last flush.
+** Return a table with the result of each statement in order (a Cursor
+** object, the number of tuples affected, or false if it failed) and,
+** if any failed, a table with their error messages.
+*/
+static int pipeline_flush (lua_State *L) {
+	return pipeline_sync (L, getpipeline (L), 1);
+}
+
+
+/*
+** Leave pipeline mode, discarding the results not flushed yet.
+*/
+static void pipeline_end (lua_State *L, pipeline_data *p) {
+	conn_data *conn = p->conn_data;
+	p->closed = 1;
+	if (!conn->closed) {
+		if (p->queued > 0)
+			pipeline_sync (L, p, 0);
+		PQexitPipelineMode (conn->pg_conn);
+		conn->pipeline = 0;
+	}
+	luaL_unref (L, LUA_REGISTRYINDEX, p->conn);
+}
+
+
+/*
+** Pipeline object collector function
+*/
+static int pipeline_gc (lua_State *L) {
+	pipeline_data *p = (pipeline_data *)luaL_checkudata (L, 1, LUASQL_PIPELINE_PG);
+	if (p != NULL && !(p->closed))
+		pipeline_end (L, p);
+	return 0;
+}
+
+
+/*
+** Closes the pipeline on top of the stack, leaving pipeline mode.
+** Results not flushed are discarded.
+** Returns true in case of success, or false in case the pipeline was
+** already closed.
+*/
+static int pipeline_close (lua_State *L) {
+	pipeline_data *p = (pipeline_data *)luaL_checkudata (L, 1, LUASQL_PIPELINE_PG);
+	luaL_argcheck (L, p != NULL, 1, LUASQL_PREFIX"pipeline expected");
+	if (p->closed) {
+		lua_pushboolean (L, 0);
+		lua_pushstring (L, "pipeline is already closed");
+		return 2;
+	}
+	pipeline_end (L, p);
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+
+/*
+** Put the connection in pipeline mode.
+** Without arguments, return a Pipeline object. Given a function, call
+** it with the Pipeline object, then flush and close the pipeline and
+** return the results of the flush; errors raised by the function close
+** the pipeline and are propagated.
+*/
+static int conn_pipeline (lua_State *L) {
+	conn_data *conn = getidleconnection (L);
+	pipeline_data *p;
+	int n;
+
+	if (!lua_isnoneornil (L, 2))
+		luaL_checktype (L, 2, LUA_TFUNCTION);
+	if (!PQenterPipelineMode (conn->pg_conn))
+		return luasql_failmsg(L, "error entering pipeline mode. PostgreSQL: ", PQerrorMessage(conn->pg_conn));
+	conn->pipeline = 1;
+
+	p = (pipeline_data *)LUASQL_NEWUD (L, sizeof (pipeline_data));
+	luasql_setmeta (L, LUASQL_PIPELINE_PG);
+
+	/* fill in structure */
+	p->closed = 0;
+	p->conn_data = conn;
+	p->queued = 0;
+	lua_pushvalue (L, 1);
+	p->conn = luaL_ref (L, LUA_REGISTRYINDEX);
+	if (lua_isnoneornil (L, 2))
+		return 1;
+
+	lua_pushvalue (L, 2);
+	lua_pushvalue (L, -2);
+	if (lua_pcall (L, 1, 0, 0) != 0) {
+		if (!p->closed)
+			pipeline_end (L, p);
+		return lua_error (L);
+	}
+	/* the function may have closed the pipeline or the connection */
+	if (p->closed || conn->closed) {
+		if (!p->closed)
+			pipeline_end (L, p);
+		return luasql_faildirect(L, "pipeline was closed");
+	}
+	n = pipeline_sync (L, p, 1);
+	pipeline_end (L, p);
+	return n;
+}
+#endif
+
+
 /*
 ** Commit the current transaction.
 */
 static int conn_commit (lua_State *L) {
-	conn_data *conn = getconnection (L);
+	conn_data *conn = getidleconnection (L);
 	sql_commit(conn);
 	if (conn->auto_commit == 0) {
 		sql_begin(conn);
@@ -452,7 +1325,7 @@ static int conn_commit (lua_State *L) {
 ** Rollback the current transaction.
 */
 static int conn_rollback (lua_State *L) {
-	conn_data *conn = getconnection (L);
+	conn_data *conn = getidleconnection (L);
 	sql_rollback(conn);
 	if (conn->auto_commit == 0) {
 		sql_begin(conn);
@@ -469,7 +1342,7 @@ static int conn_rollback (lua_State *L) {
 ** If 'false', then start a new transaction.
 */
 static int conn_setautocommit (lua_State *L) {
-	conn_data *conn = getconnection (L);
+	conn_data *conn = getidleconnection (L);
 	if (lua_toboolean (L, 2)) {
 		conn->auto_commit = 1;
 		sql_rollback(conn); /* Undo active transaction. */
@@ -494,6 +1367,11 @@ static int create_connection (lua_State *L, int env, PGconn *const pg_conn) {
 	conn->closed = 0;
 	conn->env = LUA_NOREF;
 	conn->auto_commit = 1;
+	conn->typenames = LUA_NOREF;
+	conn->typenames_pid = 0;
+	conn->streaming = 0;
+	conn->pipeline = 0;
+	conn->stmt_counter = 0;
 	conn->pg_conn = pg_conn;
 	lua_pushvalue (L, env);
 	conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
@@ -530,6 +1408,39 @@ static int env_connect (lua_State *L) {
 }
 
 
+/*
+** Blob value collector function.
+*/
+static int blobvalue_gc (lua_State *L) {
+	blobvalue_data *blob = (blobvalue_data *)luaL_checkudata (L, 1, LUASQL_BLOBVALUE_PG);
+	if (blob != NULL && !(blob->closed)) {
+		blob->closed = 1;
+		luaL_unref (L, LUA_REGISTRYINDEX, blob->ref);
+	}
+	return 0;
+}
+
+
+/*
+** Wrap a string so that it is bound as a bytea instead of text.
+** The string is referenced, not copied.
+*/
+static int create_blobvalue (lua_State *L) {
+	size_t len;
+	const char *data = luaL_checklstring (L, 1, &len);
+	blobvalue_data *blob = (blobvalue_data *)LUASQL_NEWUD (L, sizeof (blobvalue_data));
+	luasql_setmeta (L, LUASQL_BLOBVALUE_PG);
+
+	/* fill in structure */
+	blob->closed = 0;
+	lua_pushvalue (L, 1);
+	blob->ref = luaL_ref (L, LUA_REGISTRYINDEX);
+	blob->data = data;
+	blob->len = len;
+	return 1;
+}
+
+
 /*
 ** Environment object collector function.
 */
@@ -579,6 +1490,11 @@ static void create_metatables (lua_State *L) {
 		{"close",         conn_close},
 		{"escape",        conn_escape},
 		{"execute",       conn_execute},
+		{"executestream", conn_executestream},
+		{"prepare",       conn_prepare},
+#ifdef LIBPQ_HAS_PIPELINING
+		{"pipeline",      conn_pipeline},
+#endif
 		{"commit",        conn_commit},
 		{"rollback",      conn_rollback},
 		{"setautocommit", conn_setautocommit},
@@ -594,10 +1510,38 @@ static void create_metatables (lua_State *L) {
 		{"numrows",     cur_numrows},
 		{NULL, NULL},
 	};
+	struct luaL_Reg statement_methods[] = {
+		{"__gc",          stmt_gc},
+		{"__close",       stmt_gc},
+		{"close",         stmt_close},
+		{"execute",       stmt_execute},
+		{"getparamtypes", stmt_getparamtypes},
+		{NULL, NULL},
+	};
+#ifdef LIBPQ_HAS_PIPELINING
+	struct luaL_Reg pipeline_methods[] = {
+		{"__gc",        pipeline_gc},
+		{"__close",     pipeline_gc},
+		{"close",       pipeline_close},
+		{"execute",     pipeline_execute},
+		{"flush",       pipeline_flush},
+		{NULL, NULL},
+	};
+#endif
+	struct luaL_Reg blobvalue_methods[] = {
+		{"__gc",        blobvalue_gc},
+		{NULL, NULL},
+	};
 	luasql_createmeta (L, LUASQL_ENVIRONMENT_PG, environment_methods);
 	luasql_createmeta (L, LUASQL_CONNECTION_PG, connection_methods);
 	luasql_createmeta (L, LUASQL_CURSOR_PG, cursor_methods);
-	lua_pop (L, 3);
+	luasql_createmeta (L, LUASQL_STATEMENT_PG, statement_methods);
+	luasql_createmeta (L, LUASQL_BLOBVALUE_PG, blobvalue_methods);
+	lua_pop (L, 5);
+#ifdef LIBPQ_HAS_PIPELINING
+	luasql_createmeta (L, LUASQL_PIPELINE_PG, pipeline_methods);
+	lua_pop (L, 1);
+#endif
 }
 
 /*
@@ -620,6 +1564,7 @@ static int create_environment (lua_State *L) {
 LUASQL_API int luaopen_luasql_postgres (lua_State *L) {
 	struct luaL_Reg driver[] = {
 		{"postgres", create_environment},
+		{"blob", create_blobvalue},
 		{NULL, NULL},
 	};
 	create_metatables (L);
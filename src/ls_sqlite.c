@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include "sqlite.h"
 
@@ -25,12 +26,23 @@ typedef struct {
 } env_data;
 
 
+/* Compiled vm kept for reuse */
+typedef struct {
+	char       *sql;                /* text of the statement */
+	sqlite_vm  *vm;
+} vm_entry;
+
+
 typedef struct {
 	short        closed;
 	int          env;                /* reference to environment */
 	short        auto_commit;        /* 0 for manual commit */
+	short        typed;              /* convert numeric columns to numbers */
 	unsigned int cur_counter;
 	sqlite      *sql_conn;
+	vm_entry    *vm_cache;           /* reusable vms, most recently used first */
+	int          vm_cache_size;      /* maximum number of cached vms */
+	int          vm_cache_used;      /* number of cached vms */
 } conn_data;
 
 
@@ -39,6 +51,9 @@ typedef struct {
 	int         conn;               /* reference to connection */
 	int         numcols;            /* number of columns */
 	int         colnames, coltypes; /* reference to column information tables */
+	conn_data  *conn_data;          /* connection of the cursor */
+	char       *sql;                /* statement text if the vm is reusable */
+	char       *numeric;            /* per-column flags of typed conversion */
 	sqlite_vm  *sql_vm;
 } cur_data;
 
@@ -76,6 +91,95 @@ static cur_data *getcursor(lua_State *L) {
 }
 
 
+/*
+** Finalize the 'n' least recently used vms of the cache.
+*/
+static void cache_trim(conn_data *conn, int n) {
+	while (n-- > 0 && conn->vm_cache_used > 0) {
+		vm_entry *e = &conn->vm_cache[--conn->vm_cache_used];
+		sqlite_finalize(e->vm, NULL);
+		free(e->sql);
+	}
+}
+
+
+/*
+** Take the cached vm compiled from 'sql' out of the cache.
+** Return NULL if there is none.
+*/
+static sqlite_vm *cache_take(conn_data *conn, const char *sql) {
+	int i;
+	for (i = 0; i < conn->vm_cache_used; i++) {
+		vm_entry *e = &conn->vm_cache[i];
+		if (strcmp(e->sql, sql) == 0) {
+			sqlite_vm *vm = e->vm;
+			free(e->sql);
+			memmove(e, e + 1, (conn->vm_cache_used - i - 1) * sizeof(vm_entry));
+			conn->vm_cache_used--;
+			return vm;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+** Reset a vm compiled from 'sql' and put it in front of the cache,
+** finalizing the least recently used vm if the cache is full.
+** The vm is finalized instead if it cannot be cached.
+** Return the result of the reset: its last execution failed if it is
+** not SQLITE_OK, and then 'errmsg' receives the error message.
+*/
+static int cache_put(conn_data *conn, const char *sql, sqlite_vm *vm,
+		char **errmsg) {
+	char *copy;
+	int res;
+
+	if (conn->closed || conn->vm_cache_size == 0 ||
+			(copy = (char *)malloc(strlen(sql) + 1)) == NULL)
+		return sqlite_finalize(vm, errmsg);
+	res = sqlite_reset(vm, errmsg);
+	if (res != SQLITE_OK) {
+		/* do not keep a vm whose execution failed */
+		free(copy);
+		sqlite_finalize(vm, NULL);
+		return res;
+	}
+	if (conn->vm_cache_used == conn->vm_cache_size)
+		cache_trim(conn, 1);
+	memmove(conn->vm_cache + 1, conn->vm_cache,
+			conn->vm_cache_used * sizeof(vm_entry));
+	strcpy(copy, sql);
+	conn->vm_cache[0].sql = copy;
+	conn->vm_cache[0].vm = vm;
+	conn->vm_cache_used++;
+	return res;
+}
+
+
+/*
+** Finalize all cached vms and free the cache.
+*/
+static void conn_freecache(conn_data *conn) {
+	cache_trim(conn, conn->vm_cache_used);
+	free(conn->vm_cache);
+	conn->vm_cache = NULL;
+	conn->vm_cache_size = 0;
+}
+
+
+/*
+** Release the vm of a cursor: it goes back to the cache of its
+** connection if it is reusable, otherwise it is finalized.
+** Return the result of the last execution of the vm.
+*/
+static int cur_release_vm(cur_data *cur, char **errmsg) {
+	if (cur->sql != NULL)
+		return cache_put(cur->conn_data, cur->sql, cur->sql_vm, errmsg);
+	return sqlite_finalize(cur->sql_vm, errmsg);
+}
+
+
 /*
 ** Closes the cursor and nullify all structure fields.
 */
@@ -85,6 +189,8 @@ static void cur_nullify(lua_State *L, cur_data *cur) {
   /* Nullify structure fields. */
   cur->closed = 1;
   cur->sql_vm = NULL;
+  free(cur->sql);
+  cur->sql = NULL;
   /* Decrement cursor counter on connection object */
   lua_rawgeti (L, LUA_REGISTRYINDEX, cur->conn);
   conn = lua_touserdata (L, -1);
@@ -102,7 +208,7 @@ static void cur_nullify(lua_State *L, cur_data *cur) {
 */
 static int finalize(lua_State *L, cur_data *cur) {
 	char *errmsg;
-	if (sqlite_finalize(cur->sql_vm, &errmsg) != SQLITE_OK) {
+	if (cur_release_vm(cur, &errmsg) != SQLITE_OK) {
 		cur_nullify(L, cur);
 		lua_pushnil(L);
 		lua_pushliteral(L, LUASQL_PREFIX);
@@ -117,6 +223,40 @@ static int finalize(lua_State *L, cur_data *cur) {
 }
 
 
+/*
+** Push the value of a cell.
+** If 'numeric' is true, a value that is a decimal number is pushed as a
+** Lua number (an integer if possible); otherwise values are strings.
+*/
+static void push_cell(lua_State *L, const char *value, int numeric) {
+	if (value == NULL) {
+		lua_pushnil(L);
+		return;
+	}
+	if (numeric && value[0] != '\0' &&
+			value[strspn(value, "0123456789+-.eE")] == '\0') {
+		char *end;
+#if LUA_VERSION_NUM >= 503
+		long long i;
+		errno = 0;
+		i = strtoll(value, &end, 10);
+		if (*end == '\0' && errno == 0) {
+			lua_pushinteger(L, (lua_Integer)i);
+			return;
+		}
+#endif
+		{
+			double d = strtod(value, &end);
+			if (*end == '\0') {
+				lua_pushnumber(L, d);
+				return;
+			}
+		}
+	}
+	lua_pushstring(L, value);
+}
+
+
 /*
 ** Get another row of the given cursor.
 */
@@ -147,9 +287,9 @@ static int cur_fetch (lua_State *L) {
 
 		if (strchr(opts, 'n') != NULL) {
 			/* Copy values to numerical indices */
-			for (i = 0; i < cur->numcols;) {
-				lua_pushstring(L, row[i]);
-				lua_rawseti(L, 2, ++i);
+			for (i = 0; i < cur->numcols; i++) {
+				push_cell(L, row[i], cur->numeric[i]);
+				lua_rawseti(L, 2, i+1);
 			}
 		}
 		if (strchr(opts, 'a') != NULL) {
@@ -158,7 +298,7 @@ static int cur_fetch (lua_State *L) {
 
 			for (i = 0; i < cur->numcols; i++) {
 				lua_rawgeti(L, -1, i+1);
-				lua_pushstring(L, row[i]);
+				push_cell(L, row[i], cur->numeric[i]);
 				lua_rawset (L, 2);
 			}
 		}
@@ -169,7 +309,7 @@ static int cur_fetch (lua_State *L) {
 		int i;
 		luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
 		for (i = 0; i < cur->numcols; ++i)
-			lua_pushstring(L, row[i]);
+			push_cell(L, row[i], cur->numeric[i]);
 		return cur->numcols; /* return #numcols values */
 	}
 }
@@ -181,7 +321,7 @@ static int cur_fetch (lua_State *L) {
 static int cur_gc(lua_State *L) {
 	cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
 	if (cur != NULL && !(cur->closed)) {
-		sqlite_finalize(cur->sql_vm, NULL);
+		cur_release_vm(cur, NULL);
 		cur_nullify(L, cur);
 	}
 	return 0;
@@ -200,7 +340,7 @@ static int cur_close(lua_State *L) {
 		lua_pushstring (L, "cursor is already closed");
 		return 2;
 	}
-	sqlite_finalize(cur->sql_vm, NULL);
+	cur_release_vm(cur, NULL);
 	cur_nullify(L, cur);
 	lua_pushboolean(L, 1);
 	return 1;
@@ -227,16 +367,46 @@ static int cur_getcoltypes(lua_State *L) {
 }
 
 
+/*
+** Check whether the declared type of a column gives it numeric
+** affinity: SQLite 2 stores values of any type containing BLOB, CHAR,
+** CLOB or TEXT as text and all others as numbers when possible.
+*/
+static int numeric_type(const char *type) {
+	static const char *const text_types[] = { "BLOB", "CHAR", "CLOB", "TEXT", NULL };
+	const char *p;
+	int i;
+
+	if (type == NULL)
+		return 0;
+	for (p = type; *p != '\0'; p++) {
+		for (i = 0; text_types[i] != NULL; i++) {
+			const char *t = text_types[i];
+			int j = 0;
+			while (t[j] != '\0' && toupper((unsigned char)p[j]) == t[j])
+				j++;
+			if (t[j] == '\0')
+				return 0;
+		}
+	}
+	return 1;
+}
+
+
 /*
 ** Create a new Cursor object and push it on top of the stack.
+** 'sql' is the statement text if the vm can be reused, NULL otherwise;
+** the cursor keeps a copy of it.
 */
 /* static int create_cursor(lua_State *L, int conn, sqlite_vm *sql_vm,
 	int numcols, const char **row, const char **col_info)*/
 static int create_cursor(lua_State *L, int o, conn_data *conn,
-		sqlite_vm *sql_vm, int numcols, const char **col_info)
+		sqlite_vm *sql_vm, int numcols, const char **col_info,
+		const char *sql)
 {
 	int i;
-	cur_data *cur = (cur_data*)LUASQL_NEWUD(L, sizeof(cur_data));
+	/* the typed conversion flags follow the structure */
+	cur_data *cur = (cur_data*)LUASQL_NEWUD(L, sizeof(cur_data) + numcols);
 	luasql_setmeta (L, LUASQL_CURSOR_SQLITE);
 
 	/* increment cursor count for the connection creating this cursor */
@@ -248,7 +418,14 @@ static int create_cursor(lua_State *L, int o, conn_data *conn,
 	cur->numcols = numcols;
 	cur->colnames = LUA_NOREF;
 	cur->coltypes = LUA_NOREF;
+	cur->conn_data = conn;
+	cur->sql = NULL;
+	cur->numeric = (char *)(cur + 1);
 	cur->sql_vm = sql_vm;
+	for (i = 0; i < numcols; i++)
+		cur->numeric[i] = conn->typed && numeric_type(col_info[numcols+i]);
+	if (sql != NULL && (cur->sql = (char *)malloc(strlen(sql) + 1)) != NULL)
+		strcpy(cur->sql, sql);
 
 	lua_pushvalue(L, o);
 	cur->conn = luaL_ref(L, LUA_REGISTRYINDEX);
@@ -283,6 +460,7 @@ static int conn_gc(lua_State *L) {
 		/* Nullify structure fields. */
 		conn->closed = 1;
 		luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
+		conn_freecache(conn);
 		sqlite_close(conn->sql_conn);
 	}
 	return 0;
@@ -308,6 +486,7 @@ static int conn_close (lua_State *L) {
 	}
 	conn->closed = 1;
 	luaL_unref (L, LUA_REGISTRYINDEX, conn->env);
+	conn_freecache (conn);
 	sqlite_close (conn->sql_conn);
 	
 	lua_pushboolean (L, 1);
@@ -319,40 +498,74 @@ static int conn_close (lua_State *L) {
 ** Execute an SQL statement.
 ** Return a Cursor object if the statement is a query, otherwise
 ** return the number of tuples affected by the statement.
+** With a vm cache, the vm of a statement whose text was already
+** executed is reused instead of compiling it again.
 */
 static int conn_execute(lua_State *L) {
 	conn_data *conn = getconnection(L);
 	const char *statement = luaL_checkstring(L, 2);
+	const char *tail = NULL;
 	int res;
-	sqlite_vm *vm;
+	sqlite_vm *vm = NULL;
 	char *errmsg;
 	int numcols;
 	const char **col_info;
 
-	res = sqlite_compile(conn->sql_conn, statement, NULL, &vm, &errmsg);
-	if (res != SQLITE_OK) {
-		lua_pushnil(L);
-		lua_pushliteral(L, LUASQL_PREFIX);
-		lua_pushstring(L, errmsg);
-		sqlite_freemem(errmsg);
-		lua_concat(L, 2);
-		return 2;
+	if (conn->vm_cache_size > 0)
+		vm = cache_take(conn, statement);
+	if (vm != NULL) {
+		/* process first result to retrieve query information and type */
+		res = sqlite_step(vm, &numcols, NULL, &col_info);
+		if (res != SQLITE_ROW && res != SQLITE_DONE) {
+			res = sqlite_finalize(vm, &errmsg);
+			if (res != SQLITE_SCHEMA) {
+				lua_pushnil(L);
+				lua_pushliteral(L, LUASQL_PREFIX);
+				lua_pushstring(L, errmsg);
+				sqlite_freemem(errmsg);
+				lua_concat(L, 2);
+				return 2;
+			}
+			/* the schema has changed: compile the statement again */
+			sqlite_freemem(errmsg);
+			vm = NULL;
+		}
 	}
-
-	/* process first result to retrieve query information and type */
-	res = sqlite_step(vm, &numcols, NULL, &col_info);
+	if (vm == NULL) {
+		res = sqlite_compile(conn->sql_conn, statement, &tail, &vm, &errmsg);
+		if (res != SQLITE_OK) {
+			lua_pushnil(L);
+			lua_pushliteral(L, LUASQL_PREFIX);
+			lua_pushstring(L, errmsg);
+			sqlite_freemem(errmsg);
+			lua_concat(L, 2);
+			return 2;
+		}
+		/* process first result to retrieve query information and type */
+		res = sqlite_step(vm, &numcols, NULL, &col_info);
+	}
+	/* only single statements can be reused */
+	if (tail != NULL) {
+		while (isspace((unsigned char)*tail) || *tail == ';')
+			tail++;
+	}
+	if (conn->vm_cache_size == 0 || (tail != NULL && *tail != '\0'))
+		statement = NULL;
 
 	/* real query? if empty, must have numcols!=0 */
 	if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols)) {
 		sqlite_reset(vm, NULL);
-		return create_cursor(L, 1, conn, vm, numcols, col_info);
+		return create_cursor(L, 1, conn, vm, numcols, col_info, statement);
 	}
 
 	if (res == SQLITE_DONE) /* and numcols==0, INSERT,UPDATE,DELETE statement */
 	{
-		sqlite_finalize(vm, NULL);
 		/* return number of columns changed */
 		lua_pushnumber(L, sqlite_changes(conn->sql_conn));
+		if (statement != NULL)
+			cache_put(conn, statement, vm, NULL);
+		else
+			sqlite_finalize(vm, NULL);
 		return 1;
 	}
 
@@ -462,8 +675,12 @@ static int create_connection(lua_State *L, int env, sqlite *sql_conn) {
 	conn->closed = 0;
 	conn->env = LUA_NOREF;
 	conn->auto_commit = 1;
+	conn->typed = 0;
 	conn->sql_conn = sql_conn;
 	conn->cur_counter = 0;
+	conn->vm_cache = NULL;
+	conn->vm_cache_size = 0;
+	conn->vm_cache_used = 0;
 	lua_pushvalue (L, env);
 	conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
 	return 1;
@@ -472,13 +689,28 @@ static int create_connection(lua_State *L, int env, sqlite *sql_conn) {
 
 /*
 ** Connects to a data source.
+** An optional table of options may follow the source name: 'typed'
+** converts the values of numeric columns to numbers and 'vmcache'
+** gives the number of compiled vms kept for reuse.
 */
 static int env_connect(lua_State *L) {
 	const char *sourcename;
 	sqlite *conn;
 	char *errmsg;
+	int typed = 0;
+	int vmcache = 0;
+	conn_data *cdata;
 	getenvironment(L);  /* validate environment */
 	sourcename = luaL_checkstring(L, 2);
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "typed");
+		typed = lua_toboolean(L, -1);
+		lua_getfield(L, 3, "vmcache");
+		vmcache = (int)lua_tonumber(L, -1);
+		luaL_argcheck(L, vmcache >= 0, 3, LUASQL_PREFIX"invalid vm cache size");
+		lua_pop(L, 2);
+	}
 	conn = sqlite_open(sourcename, 0, &errmsg);
 	if (conn == NULL) {
 		lua_pushnil(L);
@@ -488,7 +720,15 @@ static int env_connect(lua_State *L) {
 		lua_concat(L, 2);
 		return 2;
 	}
-	return create_connection(L, 1, conn);
+	create_connection(L, 1, conn);
+	cdata = (conn_data *)lua_touserdata(L, -1);
+	cdata->typed = typed;
+	if (vmcache > 0) {
+		cdata->vm_cache = (vm_entry *)malloc(vmcache * sizeof(vm_entry));
+		if (cdata->vm_cache != NULL)
+			cdata->vm_cache_size = vmcache;
+	}
+	return 1;
 }
 
 
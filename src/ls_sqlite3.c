@@ -12,6 +12,13 @@
 
 #include "sqlite3.h"
 
+#if !defined(_WIN32) && SQLITE_VERSION_NUMBER >= 3014000
+#define LUASQL_SQLITE3_ASYNC
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
 #include "lua.h"
 #include "lauxlib.h"
 
@@ -21,10 +28,47 @@
 #define LUASQL_ENVIRONMENT_SQLITE "SQLite3 environment"
 #define LUASQL_CONNECTION_SQLITE "SQLite3 connection"
 #define LUASQL_CURSOR_SQLITE "SQLite3 cursor"
+#define LUASQL_STATEMENT_SQLITE "SQLite3 statement"
+#define LUASQL_BLOB_SQLITE "SQLite3 blob"
+#define LUASQL_BACKUP_SQLITE "SQLite3 backup"
+#define LUASQL_BLOBVALUE_SQLITE "SQLite3 blob value"
+#define LUASQL_ASYNC_SQLITE "SQLite3 async query"
+
+#if LUA_VERSION_NUM >= 502
+#define luasql_rawlen lua_rawlen
+#else
+#define luasql_rawlen lua_objlen
+#endif
+
+/* VM steps between checks of the budgets of a call */
+#define BUDGET_PERIOD 1000
+
+/* Largest number of rows preallocated by cur:fetchcolumns */
+#define FETCH_PRESIZE 256
+
+/* Process-wide shared cache of a database, kept open by an anchor
+   connection while some environment uses it */
+typedef struct shared_cache
+{
+  char                *path;
+  sqlite3             *anchor;
+  int                 refs;        /* number of environments using it */
+  struct shared_cache *next;
+} shared_cache;
+
+
+/* Shared cache used by an environment */
+typedef struct shared_use
+{
+  shared_cache        *cache;
+  struct shared_use   *next;
+} shared_use;
+
 
 typedef struct
 {
   short       closed;
+  shared_use  *shared;             /* shared caches used by the environment */
 } env_data;
 
 
@@ -34,19 +78,225 @@ typedef struct
   int          env;                /* reference to environment */
   short        auto_commit;        /* 0 for manual commit */
   unsigned int cur_counter;
+  unsigned int stmt_counter;
+  unsigned int blob_counter;
+  unsigned int backup_counter;
   sqlite3      *sql_conn;
+  lua_State    *func_L;            /* thread running the Lua SQL functions */
+  int          func_thread;        /* reference to this thread */
+  int          func_users;         /* callbacks which use this thread */
+  int          schema_lock;        /* cursors lock their accessors */
+  int          profile_fn;         /* reference to the profile handler */
+  struct profile_entry *profile;   /* ring buffer of profiled statements */
+  int          profile_size;
+  int          profile_next;       /* next slot to be written */
+  int          profile_used;
+  double       budget_time;        /* seconds allowed per call, 0 if unlimited */
+  double       budget_steps;       /* VM steps allowed per call, 0 if unlimited */
+  double       budget_start;       /* start of the current call */
+  double       budget_used;        /* VM steps run by the current call */
+  const char   *budget_exceeded;   /* error message of an exceeded budget */
+  int          budget_running;     /* a call with budgets is running */
+  int          budget_period;      /* VM steps between budget checks */
+  struct async_data *async;        /* asynchronous query running, if any */
+  struct deferred_release *deferred; /* releases waiting for the query */
+  struct cache_entry *stmt_cache;  /* cached vms, most recently used first */
+  int          stmt_cache_size;    /* maximum number of cached vms */
+  int          stmt_cache_used;    /* number of cached vms */
+  unsigned long stmt_cache_hits, stmt_cache_misses, stmt_cache_evictions;
 } conn_data;
 
 
+typedef struct
+{
+  short        closed;
+  int          conn;               /* reference to connection */
+  unsigned int cur_counter;
+  conn_data    *conn_data;         /* reference to connection for statement */
+  sqlite3_stmt *sql_vm;
+} stmt_data;
+
+
+typedef struct
+{
+  short        closed;
+  int          conn;               /* reference to connection */
+  conn_data    *conn_data;         /* reference to connection for blob */
+  sqlite3_blob *blob;
+} blob_data;
+
+
+typedef struct
+{
+  short          closed;
+  int            conn;             /* reference to source connection */
+  int            dest;             /* reference to destination connection */
+  conn_data      *conn_data;       /* source connection */
+  conn_data      *dest_data;       /* destination connection (NULL if owned) */
+  sqlite3        *dest_db;         /* destination database */
+  int            pages;            /* default number of pages per step */
+  sqlite3_backup *backup;
+} backup_data;
+
+
+/* Kinds of deferred releases */
+enum { DEFER_VM, DEFER_FINALIZE, DEFER_BLOB, DEFER_BACKUP, DEFER_CLOSE };
+
+/* Release of an object collected while an asynchronous query was
+   running, done once the query is finished */
+typedef struct deferred_release
+{
+  int                     kind;
+  void                    *p;
+  struct deferred_release *next;
+} deferred_release;
+
+
+#ifdef LUASQL_SQLITE3_ASYNC
+/* Query run by a worker thread */
+typedef struct async_data
+{
+  short           closed;
+  int             conn;            /* reference to connection */
+  conn_data       *conn_data;
+  sqlite3_stmt    *vm;
+  pthread_t       thread;
+  int             joined;
+  pthread_mutex_t mutex;           /* protects 'done' and 'cancel' */
+  int             done;
+  int             cancel;          /* the query must stop */
+  int             fds[2];          /* pipe written when the query is done */
+  int             res;             /* result code of the last step */
+  char            *errmsg;
+  int             numcols;
+  double          changes;
+  sqlite3_value   **values;        /* 'numcols' values per row */
+  int             rows;
+  int             capacity;        /* rows */
+} async_data;
+#endif
+
+
+/* Vm kept by the statement cache */
+typedef struct cache_entry
+{
+  char          *sql;              /* SQL text given by the caller */
+  unsigned int  hash;              /* hash of 'sql' */
+  sqlite3_stmt  *vm;
+  int           in_use;            /* vm checked out by a cursor or call */
+} cache_entry;
+
+
+/* String to be bound as a BLOB */
+typedef struct
+{
+  short        closed;
+  int          ref;                /* reference to the string */
+  const char   *data;
+  size_t       len;
+} blobvalue_data;
+
+
+/* Statement counters recorded by the profiler */
+static const struct {
+  const char *name;
+  int         op;
+} profile_counters[] = {
+  {"fullscan_step", SQLITE_STMTSTATUS_FULLSCAN_STEP},
+  {"sort", SQLITE_STMTSTATUS_SORT},
+  {"autoindex", SQLITE_STMTSTATUS_AUTOINDEX},
+  {"vm_step", SQLITE_STMTSTATUS_VM_STEP},
+#ifdef SQLITE_STMTSTATUS_MEMUSED
+  {"memused", SQLITE_STMTSTATUS_MEMUSED},
+#endif
+};
+
+#define PROFILE_COUNTERS (int)(sizeof(profile_counters) / sizeof(profile_counters[0]))
+
+
+/* Record of a profiled statement */
+typedef struct profile_entry
+{
+  char          *sql;              /* expanded SQL text */
+  sqlite3_int64 time;              /* wall time in nanoseconds */
+  int           counters[PROFILE_COUNTERS];
+} profile_entry;
+
+
+/* Lua function registered as an SQL function */
+typedef struct
+{
+  lua_State    *L;                 /* thread where the function runs */
+  conn_data    *conn;
+  int          fn, final;          /* references to the Lua functions */
+} func_data;
+
+
+/* State of an aggregate function in one group */
+typedef struct
+{
+  short        initialized;
+  int          ref;                /* reference to the state value */
+} aggr_data;
+
+
+#if SQLITE_VERSION_NUMBER >= 3009000
+/* Virtual table module implemented by a Lua provider */
+typedef struct
+{
+  lua_State    *L;                 /* thread where the provider is used */
+  conn_data    *conn;
+  int          provider;           /* reference to the provider table */
+  int          ncols;
+  int          *columns;           /* references to the column arrays
+                                      (NULL for a rows function) */
+  int          rows;               /* reference to the rows function */
+  int          index_col;          /* column with equality lookups (or -1) */
+  char         *schema;            /* declaration of the table */
+} module_data;
+
+
+typedef struct
+{
+  sqlite3_vtab base;
+  module_data  *module;
+} vtab_data;
+
+
+typedef struct
+{
+  sqlite3_vtab_cursor base;
+  sqlite3_int64 rowid;             /* current row, starting at 1 */
+  sqlite3_int64 count;             /* number of rows of the data arrays */
+  int          index;              /* reference to the lookup table */
+  int          matches;            /* reference to the rows of a lookup */
+  sqlite3_int64 match;             /* position in the lookup rows */
+  int          iter;               /* reference to the rows iterator */
+  int          row;                /* reference to the current row table */
+  int          eof;
+} vcursor_data;
+#endif
+
+
+/* Pushes the value of a column of the current row */
+typedef void (*column_pusher)(lua_State *L, sqlite3_stmt *vm, int column);
+
 typedef struct
 {
   short       closed;
   short       first_fetch;
+  short       locked;             /* whether 'pushers' is set up */
   int         conn;               /* reference to connection */
   int         numcols;            /* number of columns */
   int         colnames, coltypes; /* reference to column information tables */
+  int         stmt;               /* reference to statement (LUA_NOREF if none) */
+  int         opts;               /* reference to the last fetch options */
+  const char  *opts_str;          /* last fetch options */
+  int         opts_num, opts_names; /* flags parsed from 'opts_str' */
   conn_data   *conn_data;         /* reference to connection for cursor */
+  stmt_data   *stmt_data;         /* statement owning the vm (NULL if none) */
   sqlite3_stmt  *sql_vm;
+  column_pusher *pushers;         /* per-column accessors */
 } cur_data;
 
 
@@ -68,6 +318,8 @@ static conn_data *getconnection(lua_State *L) {
   conn_data *conn = (conn_data *)luaL_checkudata (L, 1, LUASQL_CONNECTION_SQLITE);
   luaL_argcheck(L, conn != NULL, 1, LUASQL_PREFIX"connection expected");
   luaL_argcheck(L, !conn->closed, 1, LUASQL_PREFIX"connection is closed");
+  luaL_argcheck(L, conn->async == NULL, 1,
+		LUASQL_PREFIX"connection is running an asynchronous query");
   return conn;
 }
 
@@ -79,9 +331,325 @@ static cur_data *getcursor(lua_State *L) {
   cur_data *cur = (cur_data *)luaL_checkudata (L, 1, LUASQL_CURSOR_SQLITE);
   luaL_argcheck(L, cur != NULL, 1, LUASQL_PREFIX"cursor expected");
   luaL_argcheck(L, !cur->closed, 1, LUASQL_PREFIX"cursor is closed");
+  luaL_argcheck(L, cur->conn_data->async == NULL, 1,
+		LUASQL_PREFIX"connection is running an asynchronous query");
   return cur;
 }
 
+
+/*
+** Check for valid blob.
+*/
+static blob_data *getblob(lua_State *L) {
+  blob_data *blob = (blob_data *)luaL_checkudata (L, 1, LUASQL_BLOB_SQLITE);
+  luaL_argcheck(L, blob != NULL, 1, LUASQL_PREFIX"blob expected");
+  luaL_argcheck(L, !blob->closed, 1, LUASQL_PREFIX"blob is closed");
+  luaL_argcheck(L, blob->conn_data->async == NULL, 1,
+		LUASQL_PREFIX"connection is running an asynchronous query");
+  return blob;
+}
+
+
+/*
+** Check for valid backup.
+*/
+static backup_data *getbackup(lua_State *L) {
+  backup_data *bk = (backup_data *)luaL_checkudata (L, 1, LUASQL_BACKUP_SQLITE);
+  luaL_argcheck(L, bk != NULL, 1, LUASQL_PREFIX"backup expected");
+  luaL_argcheck(L, !bk->closed, 1, LUASQL_PREFIX"backup is closed");
+  luaL_argcheck(L, bk->conn_data->async == NULL, 1,
+		LUASQL_PREFIX"connection is running an asynchronous query");
+  return bk;
+}
+
+
+/*
+** Check for valid statement.
+*/
+static stmt_data *getstatement(lua_State *L) {
+  stmt_data *stmt = (stmt_data *)luaL_checkudata (L, 1, LUASQL_STATEMENT_SQLITE);
+  luaL_argcheck(L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+  luaL_argcheck(L, !stmt->closed, 1, LUASQL_PREFIX"statement is closed");
+  luaL_argcheck(L, stmt->conn_data->async == NULL, 1,
+		LUASQL_PREFIX"connection is running an asynchronous query");
+  return stmt;
+}
+
+/*
+** Current time in seconds, from the default VFS.
+*/
+static double budget_clock(void)
+{
+  sqlite3_vfs *vfs = sqlite3_vfs_find(NULL);
+  if (vfs->iVersion >= 2 && vfs->xCurrentTimeInt64 != NULL)
+    {
+      sqlite3_int64 ms;
+      vfs->xCurrentTimeInt64(vfs, &ms);
+      return ms / 1000.0;
+    }
+  else
+    {
+      double days;
+      vfs->xCurrentTime(vfs, &days);
+      return days * 86400.0;
+    }
+}
+
+
+/*
+** Start the budgets of a call which runs the VM.
+*/
+static void conn_startbudget(conn_data *conn)
+{
+  conn->budget_exceeded = NULL;
+  conn->budget_running = 1;
+  if (conn->budget_time > 0 || conn->budget_steps > 0)
+    {
+      conn->budget_used = 0;
+      if (conn->budget_time > 0)
+        conn->budget_start = budget_clock();
+    }
+}
+
+
+/*
+** Stop the budgets of the last call, so that they do not interrupt
+** calls which are not limited, such as conn:commit.
+*/
+static void conn_stopbudget(conn_data *conn)
+{
+  conn->budget_running = 0;
+}
+
+
+/*
+** Return the message of the last error of the connection, telling
+** exceeded budgets apart from other interruptions.
+*/
+static const char *conn_errmsg(conn_data *conn)
+{
+  if (conn->budget_exceeded != NULL)
+    return conn->budget_exceeded;
+  return sqlite3_errmsg(conn->sql_conn);
+}
+
+
+/*
+** Hash of an SQL text, compared before the text itself when the
+** statement cache is searched.
+*/
+static unsigned int cache_hash(const char *statement)
+{
+  unsigned int h = 5381;
+  while (*statement)
+    h = h * 33 + (unsigned char)*statement++;
+  return h;
+}
+
+
+/*
+** Drop the least recently used entries until at most 'n' remain cached.
+** Vms not in use are finalized; entries of vms in use are only dropped
+** if 'force' is true, and such a vm is finalized by conn_release_vm
+** once it is no longer found in the cache.
+*/
+static void cache_trim(conn_data *conn, int n, int force)
+{
+  int i = conn->stmt_cache_used;
+
+  while (conn->stmt_cache_used > n && i > 0)
+    {
+      cache_entry *e = &conn->stmt_cache[--i];
+      if (e->in_use && !force)
+        continue;
+      if (!e->in_use)
+        {
+          sqlite3_finalize(e->vm);
+          conn->stmt_cache_evictions++;
+        }
+      free(e->sql);
+      memmove(e, e + 1, (conn->stmt_cache_used - i - 1) * sizeof(cache_entry));
+      conn->stmt_cache_used--;
+    }
+}
+
+
+/*
+** Check out a vm for the given SQL text.
+** A vm of the statement cache is reused when possible; otherwise the
+** text is compiled and, if it holds a single statement, the new vm is
+** added to the cache (already checked out).
+** The lookup is a linear scan of the cache, so its cost grows with the
+** size of the cache.
+** Return the result code of the compilation.
+*/
+static int conn_prepare_vm(conn_data *conn, const char *statement,
+                           sqlite3_stmt **vm)
+{
+  unsigned int hash;
+  const char *tail;
+  cache_entry *e, found;
+  int i, res;
+
+  conn_stopbudget(conn);
+  if (conn->stmt_cache_size == 0)
+    {
+#if SQLITE_VERSION_NUMBER > 3006013
+      return sqlite3_prepare_v2(conn->sql_conn, statement, -1, vm, &tail);
+#else
+      return sqlite3_prepare(conn->sql_conn, statement, -1, vm, &tail);
+#endif
+    }
+
+  hash = cache_hash(statement);
+  for (i = 0; i < conn->stmt_cache_used; i++)
+    {
+      e = &conn->stmt_cache[i];
+      if (e->hash == hash && strcmp(e->sql, statement) == 0)
+        {
+          if (e->in_use)
+            break;
+          found = *e;
+          memmove(conn->stmt_cache + 1, conn->stmt_cache,
+                  i * sizeof(cache_entry));
+          conn->stmt_cache[0] = found;
+          conn->stmt_cache[0].in_use = 1;
+          conn->stmt_cache_hits++;
+          *vm = found.vm;
+          return SQLITE_OK;
+        }
+    }
+  conn->stmt_cache_misses++;
+
+#if SQLITE_VERSION_NUMBER > 3006013
+  res = sqlite3_prepare_v2(conn->sql_conn, statement, -1, vm, &tail);
+#else
+  res = sqlite3_prepare(conn->sql_conn, statement, -1, vm, &tail);
+#endif
+  /* keep a single vm per SQL text, and only for a whole text */
+  if (res != SQLITE_OK || *vm == NULL || i < conn->stmt_cache_used
+      || *tail != '\0')
+    return res;
+
+  cache_trim(conn, conn->stmt_cache_size - 1, 0);
+  if (conn->stmt_cache_used == conn->stmt_cache_size)
+    return res;                 /* every cached vm is in use */
+  e = &conn->stmt_cache[0];
+  memmove(e + 1, e, conn->stmt_cache_used * sizeof(cache_entry));
+  e->sql = (char *)malloc(strlen(statement) + 1);
+  if (e->sql == NULL)
+    {
+      memmove(e, e + 1, conn->stmt_cache_used * sizeof(cache_entry));
+      return res;
+    }
+  strcpy(e->sql, statement);
+  e->hash = hash;
+  e->vm = *vm;
+  e->in_use = 1;
+  conn->stmt_cache_used++;
+  return res;
+}
+
+
+/*
+** Release a vm which does not belong to a statement object: a vm of
+** the statement cache is reset and kept for the next use of its SQL
+** text, otherwise it is finalized.
+** Return the result code of the last evaluation of the vm.
+*/
+static int conn_release_vm(conn_data *conn, sqlite3_stmt *vm)
+{
+  int i, res;
+
+  for (i = 0; i < conn->stmt_cache_used; i++)
+    if (conn->stmt_cache[i].vm == vm)
+      {
+        res = sqlite3_reset(vm);
+        sqlite3_clear_bindings(vm);
+        conn->stmt_cache[i].in_use = 0;
+        return res;
+      }
+  return sqlite3_finalize(vm);
+}
+
+
+/*
+** Release a native object of the connection, or defer its release
+** until the asynchronous query running on the connection, if any, is
+** finished.
+*/
+static void conn_release(conn_data *conn, int kind, void *p)
+{
+  deferred_release *d, **last;
+
+  if (conn->async != NULL)
+    {
+      /* on failure, leaking the object is better than racing with the
+         query */
+      d = (deferred_release *)malloc(sizeof(deferred_release));
+      if (d != NULL)
+        {
+          d->kind = kind;
+          d->p = p;
+          d->next = NULL;
+          for (last = &conn->deferred; *last != NULL; last = &(*last)->next)
+            ;
+          *last = d;
+        }
+      return;
+    }
+  switch (kind)
+    {
+    case DEFER_VM:
+      conn_release_vm(conn, (sqlite3_stmt *)p);
+      break;
+    case DEFER_FINALIZE:
+      sqlite3_finalize((sqlite3_stmt *)p);
+      break;
+    case DEFER_BLOB:
+      sqlite3_blob_close((sqlite3_blob *)p);
+      break;
+    case DEFER_BACKUP:
+      sqlite3_backup_finish((sqlite3_backup *)p);
+      break;
+    case DEFER_CLOSE:
+      sqlite3_close((sqlite3 *)p);
+      break;
+    }
+}
+
+
+/*
+** Do the releases deferred while an asynchronous query was running.
+*/
+static void conn_rundeferred(conn_data *conn)
+{
+  while (conn->deferred != NULL)
+    {
+      deferred_release *d = conn->deferred;
+      conn->deferred = d->next;
+      conn_release(conn, d->kind, d->p);
+      free(d);
+    }
+}
+
+
+/*
+** Check whether a method closing an object of the connection must fail
+** because of a running asynchronous query.
+** Return 0 if the object can be closed, otherwise push false and an
+** error message and return 2.
+*/
+static int conn_closepending(lua_State *L, conn_data *conn)
+{
+  if (conn->async == NULL)
+    return 0;
+  lua_pushboolean(L, 0);
+  lua_pushstring(L, "There is an asynchronous query running");
+  return 2;
+}
+
+
 /*
 ** Closes the cursor and nullify all structure fields.
 */
@@ -97,9 +665,33 @@ static void cur_nullify(lua_State *L, cur_data *cur)
   conn = lua_touserdata (L, -1);
   conn->cur_counter--;
 
+  /* Release the statement the vm belongs to, if any */
+  if (cur->stmt_data != NULL)
+    {
+      cur->stmt_data->cur_counter--;
+      cur->stmt_data = NULL;
+    }
+
   luaL_unref(L, LUA_REGISTRYINDEX, cur->conn);
   luaL_unref(L, LUA_REGISTRYINDEX, cur->colnames);
   luaL_unref(L, LUA_REGISTRYINDEX, cur->coltypes);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->stmt);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->opts);
+  cur->opts = LUA_NOREF;
+  cur->opts_str = NULL;
+}
+
+
+/*
+** Releases the vm of a cursor.
+** A vm owned by a statement object is only reset, so that it can be
+** executed again; otherwise it is released to the connection.
+*/
+static int cur_release_vm(cur_data *cur)
+{
+  if (cur->stmt_data != NULL)
+    return sqlite3_reset(cur->sql_vm);
+  return conn_release_vm(cur->conn_data, cur->sql_vm);
 }
 
 
@@ -109,9 +701,9 @@ static void cur_nullify(lua_State *L, cur_data *cur)
 */
 static int finalize(lua_State *L, cur_data *cur) {
   const char *errmsg;
-  if (sqlite3_finalize(cur->sql_vm) != SQLITE_OK)
+  if (cur_release_vm(cur) != SQLITE_OK)
     {
-      errmsg = sqlite3_errmsg(cur->conn_data->sql_conn);
+      errmsg = conn_errmsg(cur->conn_data);
       cur_nullify(L, cur);
       return luasql_faildirect(L, errmsg);
     }
@@ -121,6 +713,9 @@ static int finalize(lua_State *L, cur_data *cur) {
 }
 
 
+/*
+** Push the value of a column of the current row of a vm.
+*/
 static void push_column(lua_State *L, sqlite3_stmt *vm, int column) {
   switch (sqlite3_column_type(vm, column)) {
   case SQLITE_INTEGER:
@@ -153,65 +748,422 @@ static void push_column(lua_State *L, sqlite3_stmt *vm, int column) {
 
 
 /*
-** Get another row of the given cursor.
+** Push the value of an SQL function argument.
+** Uses the same mapping as push_column.
 */
-static int cur_fetch (lua_State *L) {
-  cur_data *cur = getcursor(L);
-  sqlite3_stmt *vm = cur->sql_vm;
-  int res;
+static void push_value(lua_State *L, sqlite3_value *value) {
+  switch (sqlite3_value_type(value)) {
+  case SQLITE_INTEGER:
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, sqlite3_value_int64(value));
+#else
+    lua_pushnumber(L, sqlite3_value_int64(value));
+#endif
+    break;
+  case SQLITE_FLOAT:
+    lua_pushnumber(L, sqlite3_value_double(value));
+    break;
+  case SQLITE_TEXT:
+    lua_pushlstring(L, (const char *)sqlite3_value_text(value),
+		    (size_t)sqlite3_value_bytes(value));
+    break;
+  case SQLITE_BLOB:
+    lua_pushlstring(L, sqlite3_value_blob(value),
+		    (size_t)sqlite3_value_bytes(value));
+    break;
+  default:
+    lua_pushnil(L);
+    break;
+  }
+}
 
-  if (vm == NULL)
-    return 0;
 
-    if (!cur->first_fetch) {
-      res = sqlite3_step(vm);
+/*
+** Column accessors of the schema lock: each one trusts the storage class
+** seen in the first row and reads the value with the matching
+** sqlite3_column_* function alone, so a value of another storage class
+** is converted by SQLite to that class.  NULL is only looked for when
+** the value read could stand for it (zero, or a NULL pointer).
+*/
+static void push_integer(lua_State *L, sqlite3_stmt *vm, int column) {
+  sqlite3_int64 value = sqlite3_column_int64(vm, column);
+  if (value == 0 && sqlite3_column_type(vm, column) == SQLITE_NULL)
+    lua_pushnil(L);
+  else
+#if LUA_VERSION_NUM >= 503
+    lua_pushinteger(L, value);
+#else
+    lua_pushnumber(L, value);
+#endif
+}
 
-      if (res == SQLITE_DONE || res != SQLITE_ROW)
-          return finalize(L, cur);
-   } else {
-      cur->first_fetch = 0;
-   }
 
-  if (lua_istable (L, 2))
-    {
-      int i;
-      const char *opts = luaL_optstring(L, 3, "n");
+static void push_float(lua_State *L, sqlite3_stmt *vm, int column) {
+  double value = sqlite3_column_double(vm, column);
+  if (value == 0 && sqlite3_column_type(vm, column) == SQLITE_NULL)
+    lua_pushnil(L);
+  else
+    lua_pushnumber(L, value);
+}
 
-      if (strchr(opts, 'n') != NULL)
-        {
-        /* Copy values to numerical indices */
-          for (i = 0; i < cur->numcols;)
-            {
-              push_column(L, vm, i);
-              lua_rawseti(L, 2, ++i);
-            }
-        }
-      if (strchr(opts, 'a') != NULL)
+
+static void push_text(lua_State *L, sqlite3_stmt *vm, int column) {
+  const char *value = (const char *)sqlite3_column_text(vm, column);
+  if (value == NULL)
+    lua_pushnil(L);
+  else
+    lua_pushlstring(L, value, (size_t)sqlite3_column_bytes(vm, column));
+}
+
+
+static void push_blob(lua_State *L, sqlite3_stmt *vm, int column) {
+  const void *value = sqlite3_column_blob(vm, column);
+  if (value != NULL)
+    lua_pushlstring(L, value, (size_t)sqlite3_column_bytes(vm, column));
+  else if (sqlite3_column_type(vm, column) == SQLITE_NULL)
+    lua_pushnil(L);
+  else  /* empty blob */
+    lua_pushliteral(L, "");
+}
+
+
+/*
+** Return the column accessors of the cursor, setting them up on the
+** current row if not done yet.
+** If the connection has the schema lock enabled, each column gets the
+** accessor of the storage class of its value in that row (columns
+** that are NULL there keep push_column); otherwise all of them use
+** push_column.
+*/
+static column_pusher *cur_lock(cur_data *cur)
+{
+  int i;
+
+  if (cur->locked)
+    return cur->pushers;
+  for (i = 0; i < cur->numcols; i++)
+    {
+      int type = cur->conn_data->schema_lock
+        ? sqlite3_column_type(cur->sql_vm, i) : SQLITE_NULL;
+      switch (type)
         {
-          /* Copy values to alphanumerical indices */
-          lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
+        case SQLITE_INTEGER: cur->pushers[i] = push_integer; break;
+        case SQLITE_FLOAT:   cur->pushers[i] = push_float;   break;
+        case SQLITE_TEXT:    cur->pushers[i] = push_text;    break;
+        case SQLITE_BLOB:    cur->pushers[i] = push_blob;    break;
+        default:             cur->pushers[i] = push_column;  break;
+        }
+    }
+  cur->locked = 1;
+  return cur->pushers;
+}
 
-          for (i = 0; i < cur->numcols; i++)
-            {
-              lua_rawgeti(L, -1, i+1);
-              push_column(L, vm, i);
-              lua_rawset (L, 2);
-            }
+
+/*
+** Move the cursor to its next row.
+** Return SQLITE_ROW if there is a row, otherwise the result of the
+** last evaluation of the vm.
+*/
+static int cur_step(cur_data *cur)
+{
+  if (cur->first_fetch)
+    {
+      /* the vm was already stepped: check whether it produced a row */
+      cur->first_fetch = 0;
+      return sqlite3_data_count(cur->sql_vm) ? SQLITE_ROW : SQLITE_DONE;
+    }
+  return sqlite3_step(cur->sql_vm);
+}
+
+
+/*
+** Copy the values of the current row to the table at stack index 't':
+** to numerical indices if 'num' is true and to alphanumerical indices
+** if 'names' is the stack index of the column names table.
+*/
+static void copy_row(lua_State *L, cur_data *cur, int t, int num, int names)
+{
+  sqlite3_stmt *vm = cur->sql_vm;
+  column_pusher *push = cur_lock(cur);
+  int numcols = cur->numcols;
+  int i;
+
+  if (num)
+    {
+      /* Copy values to numerical indices */
+      for (i = 0; i < numcols;)
+        {
+          push[i](L, vm, i);
+          lua_rawseti(L, t, ++i);
+        }
+    }
+  if (names != 0)
+    {
+      /* Copy values to alphanumerical indices */
+      for (i = 0; i < numcols; i++)
+        {
+          lua_rawgeti(L, names, i+1);
+          push[i](L, vm, i);
+          lua_rawset(L, t);
+        }
+    }
+}
+
+
+/*
+** Parse the fetch options at stack index 'arg' ("n" if absent) into
+** the 'opts_num' and 'opts_names' flags of the cursor.
+** The options string is kept referenced, so that the flags are only
+** parsed again when another string is given.
+*/
+static void cur_fetchopts(lua_State *L, cur_data *cur, int arg)
+{
+  const char *opts;
+
+  if (lua_isnoneornil(L, arg))
+    {
+      cur->opts_str = NULL;
+      cur->opts_num = 1;
+      cur->opts_names = 0;
+      return;
+    }
+  opts = luaL_checkstring(L, arg);
+  if (opts == cur->opts_str)
+    return;
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->opts);
+  lua_pushvalue(L, arg);
+  cur->opts = luaL_ref(L, LUA_REGISTRYINDEX);
+  cur->opts_str = opts;
+  cur->opts_num = strchr(opts, 'n') != NULL;
+  cur->opts_names = strchr(opts, 'a') != NULL;
+}
+
+
+/*
+** Get another row of the given cursor.
+*/
+static int cur_fetch (lua_State *L) {
+  cur_data *cur = getcursor(L);
+  sqlite3_stmt *vm = cur->sql_vm;
+
+  if (vm == NULL)
+    return 0;
+
+  conn_startbudget(cur->conn_data);
+  if (cur_step(cur) != SQLITE_ROW)
+    return finalize(L, cur);
+
+  if (lua_istable (L, 2))
+    {
+      int names = 0;
+
+      cur_fetchopts(L, cur, 3);
+      if (cur->opts_names)
+        {
+          lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
+          names = lua_gettop(L);
         }
+      copy_row(L, cur, 2, cur->opts_num, names);
       lua_pushvalue(L, 2);
       return 1; /* return table */
     }
   else
     {
+      column_pusher *push = cur_lock(cur);
       int i;
       luaL_checkstack (L, cur->numcols, LUASQL_PREFIX"too many columns");
       for (i = 0; i < cur->numcols; ++i)
-        push_column(L, vm, i);
+        push[i](L, vm, i);
       return cur->numcols; /* return #numcols values */
     }
 }
 
 
+/*
+** Fetch up to 'maxrows' rows (all of them if 'maxrows' is negative)
+** into an array of row tables built according to 'opts'.
+** When the result set is exhausted the cursor is closed, but only on
+** the next call if some rows were fetched by this one; errors are
+** reported at once.
+*/
+static int fetch_rows(lua_State *L, cur_data *cur, int maxrows,
+		      const char *opts)
+{
+  sqlite3_stmt *vm = cur->sql_vm;
+  int num = strchr(opts, 'n') != NULL;
+  int names = 0;
+  int rows = 0;
+  int list;
+  int res = SQLITE_ROW;
+
+  if (vm == NULL)
+    return 0;
+
+  conn_startbudget(cur->conn_data);
+  if (strchr(opts, 'a') != NULL)
+    {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
+      names = lua_gettop(L);
+    }
+  lua_newtable(L);
+  list = lua_gettop(L);
+
+  while (maxrows < 0 || rows < maxrows)
+    {
+      res = cur_step(cur);
+      if (res != SQLITE_ROW)
+        break;
+      lua_createtable(L, num ? cur->numcols : 0, names ? cur->numcols : 0);
+      copy_row(L, cur, list + 1, num, names);
+      lua_rawseti(L, list, ++rows);
+    }
+
+  if (res != SQLITE_ROW)
+    {
+      if (rows == 0 || res != SQLITE_DONE)
+        return finalize(L, cur);
+      /* report the end of the result set on the next call */
+      cur->first_fetch = 1;
+    }
+  lua_pushvalue(L, list);
+  return 1;
+}
+
+
+/*
+** Get up to n rows of the given cursor as an array of tables.
+*/
+static int cur_fetchmany (lua_State *L) {
+  cur_data *cur = getcursor(L);
+  int maxrows = (int)luaL_checknumber(L, 2);
+  luaL_argcheck(L, maxrows > 0, 2, LUASQL_PREFIX"invalid number of rows");
+  return fetch_rows(L, cur, maxrows, luaL_optstring(L, 3, "n"));
+}
+
+
+/*
+** Get all remaining rows of the given cursor as an array of tables.
+*/
+static int cur_fetchall (lua_State *L) {
+  cur_data *cur = getcursor(L);
+  return fetch_rows(L, cur, -1, luaL_optstring(L, 2, "n"));
+}
+
+
+/*
+** Get up to 'maxrows' rows (all remaining rows if omitted) of the given
+** cursor as one array per column.
+** Return the table of column arrays and the number of rows fetched.
+*/
+static int cur_fetchcolumns (lua_State *L) {
+  cur_data *cur = getcursor(L);
+  sqlite3_stmt *vm = cur->sql_vm;
+  column_pusher *push;
+  int maxrows = (int)luaL_optnumber(L, 2, -1);
+  int rows = 0;
+  int cols;
+  int i;
+  int res = SQLITE_ROW;
+
+  luaL_argcheck(L, maxrows > 0 || lua_isnoneornil(L, 2), 2,
+		LUASQL_PREFIX"invalid number of rows");
+  if (vm == NULL)
+    return 0;
+
+  conn_startbudget(cur->conn_data);
+  luaL_checkstack(L, cur->numcols + 2, LUASQL_PREFIX"too many columns");
+  lua_createtable(L, cur->numcols, 0);
+  cols = lua_gettop(L);
+  for (i = 0; i < cur->numcols; i++)
+    lua_createtable(L, maxrows > FETCH_PRESIZE ? FETCH_PRESIZE
+		    : (maxrows > 0 ? maxrows : 0), 0);
+
+  while (maxrows < 0 || rows < maxrows)
+    {
+      res = cur_step(cur);
+      if (res != SQLITE_ROW)
+        break;
+      rows++;
+      push = cur_lock(cur);
+      for (i = 0; i < cur->numcols; i++)
+        {
+          push[i](L, vm, i);
+          lua_rawseti(L, cols + 1 + i, rows);
+        }
+    }
+
+  if (res != SQLITE_ROW)
+    {
+      if (rows == 0 || res != SQLITE_DONE)
+        return finalize(L, cur);
+      /* report the end of the result set on the next call */
+      cur->first_fetch = 1;
+    }
+
+  /* move the column arrays into the result table */
+  for (i = cur->numcols; i > 0; i--)
+    lua_rawseti(L, cols, i);
+  lua_pushnumber(L, rows);
+  return 2;
+}
+
+
+/*
+** Iterator returned by cur:rows.
+** Upvalues: the cursor, the row table, the column names table (or nil)
+** and whether values go to numerical indices.
+*/
+static int cur_rows_iter (lua_State *L) {
+  cur_data *cur = (cur_data *)lua_touserdata(L, lua_upvalueindex(1));
+  int names = lua_isnil(L, lua_upvalueindex(3)) ? 0 : lua_upvalueindex(3);
+
+  if (cur->closed)
+    return 0;
+  if (cur->conn_data->async != NULL)
+    return luaL_error(L, LUASQL_PREFIX"connection is running an asynchronous query");
+
+  conn_startbudget(cur->conn_data);
+  if (cur_step(cur) != SQLITE_ROW)
+    {
+      /* finalize returns nil or nil and an error message */
+      if (finalize(L, cur) == 2)
+        return lua_error(L);
+      return 0;
+    }
+
+  copy_row(L, cur, lua_upvalueindex(2), lua_toboolean(L, lua_upvalueindex(4)),
+	   names);
+  lua_pushvalue(L, lua_upvalueindex(2));
+  return 1;
+}
+
+
+/*
+** Return an iterator over the rows of the cursor, for use in a generic
+** for. The same table, filled according to 'mode', is returned for every
+** row, and the cursor is closed after the last one; errors are raised.
+** The cursor is also returned as the closing value of the loop.
+*/
+static int cur_rows (lua_State *L) {
+  cur_data *cur = getcursor(L);
+  const char *opts = luaL_optstring(L, 2, "n");
+
+  lua_pushvalue(L, 1);
+  lua_createtable(L, strchr(opts, 'n') != NULL ? cur->numcols : 0,
+		  strchr(opts, 'a') != NULL ? cur->numcols : 0);
+  if (strchr(opts, 'a') != NULL)
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cur->colnames);
+  else
+    lua_pushnil(L);
+  lua_pushboolean(L, strchr(opts, 'n') != NULL);
+  lua_pushcclosure(L, cur_rows_iter, 4);
+  lua_pushnil(L);
+  lua_pushnil(L);
+  lua_pushvalue(L, 1);
+  return 4;
+}
+
+
 /*
 ** Cursor object collector function
 */
@@ -220,7 +1172,11 @@ static int cur_gc(lua_State *L)
   cur_data *cur = (cur_data *)luaL_checkudata(L, 1, LUASQL_CURSOR_SQLITE);
   if (cur != NULL && !(cur->closed))
     {
-      sqlite3_finalize(cur->sql_vm);
+      /* the vm of a statement is reset when it is executed again */
+      if (cur->stmt_data == NULL)
+        conn_release(cur->conn_data, DEFER_VM, cur->sql_vm);
+      else if (cur->conn_data->async == NULL)
+        sqlite3_reset(cur->sql_vm);
       cur_nullify(L, cur);
     }
   return 0;
@@ -240,9 +1196,11 @@ static int cur_close(lua_State *L)
     lua_pushstring(L, "cursor is already closed");
     return 2;
   }
+  if (conn_closepending(L, cur->conn_data))
+    return 2;
 
   cur->closed = 1;
-  sqlite3_finalize(cur->sql_vm);
+  cur_release_vm(cur);
   cur_nullify(L, cur);
   lua_pushboolean(L, 1);
   return 1;
@@ -273,14 +1231,18 @@ static int cur_getcoltypes(lua_State *L)
 
 /*
 ** Create a new Cursor object and push it on top of the stack.
+** If 's' is not zero, it is the (absolute) stack index of the
+** statement object which owns the vm.
 */
 /* static int create_cursor(lua_State *L, int conn, sqlite3_stmt *sql_vm,
    int numcols, const char **row, const char **col_info)*/
 static int create_cursor(lua_State *L, int o, conn_data *conn,
-			 sqlite3_stmt *sql_vm, int numcols)
+			 sqlite3_stmt *sql_vm, int numcols, int s)
 {
   int i;
-  cur_data *cur = (cur_data*)LUASQL_NEWUD(L, sizeof(cur_data));
+  /* the column accessors follow the structure */
+  cur_data *cur = (cur_data*)LUASQL_NEWUD(L, sizeof(cur_data) +
+					  numcols * sizeof(column_pusher));
   luasql_setmeta (L, LUASQL_CURSOR_SQLITE);
 
   /* increment cursor count for the connection creating this cursor */
@@ -289,16 +1251,32 @@ static int create_cursor(lua_State *L, int o, conn_data *conn,
   /* fill in structure */
   cur->closed = 0;
   cur->first_fetch = 1;
+  cur->locked = 0;
   cur->conn = LUA_NOREF;
   cur->numcols = numcols;
   cur->colnames = LUA_NOREF;
   cur->coltypes = LUA_NOREF;
+  cur->stmt = LUA_NOREF;
+  cur->opts = LUA_NOREF;
+  cur->opts_str = NULL;
+  cur->opts_num = 1;
+  cur->opts_names = 0;
   cur->sql_vm = sql_vm;
+  cur->pushers = (column_pusher *)(cur + 1);
   cur->conn_data = conn;
+  cur->stmt_data = NULL;
 
   lua_pushvalue(L, o);
   cur->conn = luaL_ref(L, LUA_REGISTRYINDEX);
 
+  if (s != 0)
+    {
+      cur->stmt_data = (stmt_data *)lua_touserdata(L, s);
+      cur->stmt_data->cur_counter++;
+      lua_pushvalue(L, s);
+      cur->stmt = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
   /* create table with column names */
   lua_newtable(L);
   for (i = 0; i < numcols;)
@@ -321,6 +1299,237 @@ static int create_cursor(lua_State *L, int o, conn_data *conn,
 }
 
 
+/*
+** Finalize all cached vms and free the statement cache.
+*/
+static void conn_freecache(conn_data *conn)
+{
+  cache_trim(conn, 0, 1);
+  free(conn->stmt_cache);
+  conn->stmt_cache = NULL;
+  conn->stmt_cache_size = 0;
+}
+
+
+/*
+** Return the thread where the Lua functions called by SQLite run,
+** creating it on first use. It is anchored by the connection until
+** the last callback using it is released by conn_releasefuncthread.
+*/
+static lua_State *conn_functhread(lua_State *L, conn_data *conn)
+{
+  if (conn->func_L == NULL)
+    {
+      conn->func_L = lua_newthread(L);
+      conn->func_thread = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  conn->func_users++;
+  return conn->func_L;
+}
+
+
+/*
+** Release a callback using the thread of the Lua functions.
+*/
+static void conn_releasefuncthread(lua_State *L, conn_data *conn)
+{
+  if (--conn->func_users > 0)
+    return;
+  luaL_unref(L, LUA_REGISTRYINDEX, conn->func_thread);
+  conn->func_thread = LUA_NOREF;
+  conn->func_L = NULL;
+}
+
+
+/*
+** Stop profiling and free the recorded statements.
+*/
+static void conn_freeprofile(lua_State *L, conn_data *conn)
+{
+  int i;
+#if SQLITE_VERSION_NUMBER >= 3014000
+  if (conn->profile_fn != LUA_NOREF || conn->profile != NULL)
+    sqlite3_trace_v2(conn->sql_conn, 0, NULL, NULL);
+#endif
+  if (conn->profile_fn != LUA_NOREF)
+    {
+      luaL_unref(L, LUA_REGISTRYINDEX, conn->profile_fn);
+      conn->profile_fn = LUA_NOREF;
+      conn_releasefuncthread(L, conn);
+    }
+  for (i = 0; i < conn->profile_size; i++)
+    sqlite3_free(conn->profile[i].sql);
+  free(conn->profile);
+  conn->profile = NULL;
+  conn->profile_size = 0;
+  conn->profile_next = 0;
+  conn->profile_used = 0;
+}
+
+
+#ifdef LUASQL_SQLITE3_ASYNC
+/*
+** Free the values of the first 'n' rows collected by an asynchronous
+** query, plus 'extra' values of the next one.
+*/
+static void async_freevalues(async_data *job, int n, int extra)
+{
+  int i;
+  for (i = 0; i < n * job->numcols + extra; i++)
+    sqlite3_value_free(job->values[i]);
+  free(job->values);
+  job->values = NULL;
+  job->rows = 0;
+  job->capacity = 0;
+}
+
+
+/*
+** Check whether an asynchronous query was asked to stop.
+*/
+static int async_cancelled(async_data *job)
+{
+  int cancel;
+  pthread_mutex_lock(&job->mutex);
+  cancel = job->cancel;
+  pthread_mutex_unlock(&job->mutex);
+  return cancel;
+}
+
+
+/*
+** Body of the worker thread: step the vm to completion, copying the
+** rows, and signal the pipe.
+** Only SQLite is used here: the Lua state belongs to the other thread.
+*/
+static void *async_worker(void *p)
+{
+  async_data *job = (async_data *)p;
+  sqlite3 *db = job->conn_data->sql_conn;
+  int res = SQLITE_INTERRUPT;
+
+  while (!async_cancelled(job) && (res = sqlite3_step(job->vm)) == SQLITE_ROW)
+    {
+      sqlite3_value **row;
+      int i;
+
+      if (job->rows == job->capacity)
+        {
+          int capacity = job->capacity ? 2 * job->capacity : 64;
+          sqlite3_value **values = (sqlite3_value **)realloc(job->values,
+              (size_t)capacity * job->numcols * sizeof(sqlite3_value *));
+          if (values == NULL)
+            {
+              res = SQLITE_NOMEM;
+              break;
+            }
+          job->values = values;
+          job->capacity = capacity;
+        }
+      row = job->values + (size_t)job->rows * job->numcols;
+      for (i = 0; i < job->numcols; i++)
+        {
+          row[i] = sqlite3_value_dup(sqlite3_column_value(job->vm, i));
+          if (row[i] == NULL)
+            break;
+        }
+      if (i < job->numcols)
+        {
+          async_freevalues(job, job->rows, i);
+          res = SQLITE_NOMEM;
+          break;
+        }
+      job->rows++;
+    }
+
+  if (res == SQLITE_DONE)
+    {
+      if (job->numcols == 0)
+        job->changes = sqlite3_changes(db);
+    }
+  else
+    {
+      const char *msg = res == SQLITE_NOMEM ? "not enough memory" :
+        conn_errmsg(job->conn_data);
+      job->errmsg = (char *)malloc(strlen(msg) + 1);
+      if (job->errmsg != NULL)
+        strcpy(job->errmsg, msg);
+    }
+  job->res = res;
+
+  pthread_mutex_lock(&job->mutex);
+  job->done = 1;
+  pthread_mutex_unlock(&job->mutex);
+  {
+    /* the pipe is only used for polling: a failed write is harmless */
+    ssize_t n = write(job->fds[1], "", 1);
+    (void)n;
+  }
+  return NULL;
+}
+
+
+/*
+** Check whether the worker thread of an asynchronous query is done.
+*/
+static int async_done(async_data *job)
+{
+  int done;
+  pthread_mutex_lock(&job->mutex);
+  done = job->done;
+  pthread_mutex_unlock(&job->mutex);
+  return done;
+}
+
+
+/*
+** Wait for the worker thread of an asynchronous query.
+*/
+static void async_join(async_data *job)
+{
+  if (!job->joined)
+    {
+      pthread_join(job->thread, NULL);
+      job->joined = 1;
+    }
+}
+
+
+/*
+** Stop an asynchronous query, if still running, and release its
+** resources, making the connection available again.
+*/
+static void async_finish(lua_State *L, async_data *job)
+{
+  conn_data *conn = job->conn_data;
+
+  /* an interruption is lost if the vm is not running yet: the worker
+     and the progress handler also check the flag */
+  if (!job->joined && !async_done(job))
+    {
+      pthread_mutex_lock(&job->mutex);
+      job->cancel = 1;
+      pthread_mutex_unlock(&job->mutex);
+      sqlite3_interrupt(conn->sql_conn);
+    }
+  async_join(job);
+  if (conn->budget_time == 0 && conn->budget_steps == 0)
+    sqlite3_progress_handler(conn->sql_conn, 0, NULL, NULL);
+  conn_release_vm(conn, job->vm);
+  async_freevalues(job, job->rows, 0);
+  free(job->errmsg);
+  job->errmsg = NULL;
+  close(job->fds[0]);
+  close(job->fds[1]);
+  pthread_mutex_destroy(&job->mutex);
+  job->closed = 1;
+  conn->async = NULL;
+  conn_rundeferred(conn);
+  luaL_unref(L, LUA_REGISTRYINDEX, job->conn);
+}
+#endif
+
+
 /*
 ** Connection object collector function
 */
@@ -330,9 +1539,16 @@ static int conn_gc(lua_State *L)
   if (conn != NULL && !(conn->closed))
     {
       /* Nullify structure fields. */
+#ifdef LUASQL_SQLITE3_ASYNC
+      if (conn->async != NULL)
+        async_finish(L, conn->async);
+#endif
       conn->closed = 1;
       luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
+      conn_freeprofile(L, conn);
+      conn_freecache(conn);
       sqlite3_close(conn->sql_conn);
+      luaL_unref(L, LUA_REGISTRYINDEX, conn->func_thread);
     }
   return 0;
 }
@@ -359,11 +1575,42 @@ static int conn_close(lua_State *L)
     return 2;
   }
 
-  conn->closed = 1;
-  luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
-  sqlite3_close(conn->sql_conn);
-
-  lua_pushboolean(L, 1);
+  if (conn->stmt_counter > 0)
+  {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "There are open statements");
+    return 2;
+  }
+
+  if (conn->blob_counter > 0)
+  {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "There are open blobs");
+    return 2;
+  }
+
+  if (conn->backup_counter > 0)
+  {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "There are open backups");
+    return 2;
+  }
+
+  if (conn->async != NULL)
+  {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "There is an asynchronous query running");
+    return 2;
+  }
+
+  conn->closed = 1;
+  luaL_unref(L, LUA_REGISTRYINDEX, conn->env);
+  conn_freeprofile(L, conn);
+  conn_freecache(conn);
+  sqlite3_close(conn->sql_conn);
+  luaL_unref(L, LUA_REGISTRYINDEX, conn->func_thread);
+
+  lua_pushboolean(L, 1);
   return 1;
 }
 
@@ -384,11 +1631,33 @@ static int conn_escape(lua_State *L)
 }
 
 
+/*
+** Return the blob value at stack index 'idx', or NULL if it is not one.
+*/
+static blobvalue_data *toblobvalue(lua_State *L, int idx)
+{
+  void *p = lua_touserdata(L, idx);
+  int same = 0;
+
+  if (p != NULL && lua_getmetatable(L, idx))
+    {
+      luaL_getmetatable(L, LUASQL_BLOBVALUE_SQLITE);
+      same = lua_rawequal(L, -1, -2);
+      lua_pop(L, 2);
+    }
+  return same ? (blobvalue_data *)p : NULL;
+}
+
+
 /*
 ** Bind one parameter.
-** Supported are the data types nil, string, boolean, number.
+** Supported are the data types nil, string, boolean, number and blob
+** values. Strings and blobs are bound with the given destructor:
+** SQLITE_STATIC avoids copying them, but then the caller must keep them
+** alive until the bindings are cleared.
 */
-static int set_param(lua_State *L, sqlite3_stmt *vm, int param_nr, int arg)
+static int set_param(lua_State *L, sqlite3_stmt *vm, int param_nr, int arg,
+		     sqlite3_destructor_type mode)
 {
   int tt = lua_type(L, arg);
   int rc = 0;
@@ -401,19 +1670,18 @@ static int set_param(lua_State *L, sqlite3_stmt *vm, int param_nr, int arg)
     case LUA_TSTRING: {
       size_t s_len;
       const char *s = lua_tolstring(L, arg, &s_len);
-      rc = sqlite3_bind_null(vm, param_nr);
-      rc = sqlite3_bind_text(vm, param_nr, s, s_len, SQLITE_TRANSIENT);
+      rc = sqlite3_bind_text(vm, param_nr, s, s_len, mode);
       break;
     }
 
     case LUA_TBOOLEAN: {
-      int val = lua_tointeger(L, arg);
+      int val = lua_toboolean(L, arg);
       rc = sqlite3_bind_int(vm, param_nr, val);
       break;
     }
 
     case LUA_TNUMBER: {
-#if defined(lua_isinteger)
+#if LUA_VERSION_NUM >= 503
       if (lua_isinteger(L, arg)) {
         lua_Integer val = lua_tointeger(L, arg);
         rc = sqlite3_bind_int64(vm, param_nr, val);
@@ -421,12 +1689,21 @@ static int set_param(lua_State *L, sqlite3_stmt *vm, int param_nr, int arg)
 #endif
         double val = lua_tonumber(L, arg);
         rc = sqlite3_bind_double(vm, param_nr, val);
-#if defined(lua_isinteger)
+#if LUA_VERSION_NUM >= 503
       }
 #endif
       break;
     }
 
+    case LUA_TUSERDATA: {
+      blobvalue_data *blob = toblobvalue(L, arg);
+      if (blob != NULL) {
+        rc = sqlite3_bind_blob(vm, param_nr, blob->data, (int)blob->len, mode);
+        break;
+      }
+    }
+    /* FALLTHROUGH */
+
     default:
     luaL_error(L, LUASQL_PREFIX"unhandled data type %s in parameter binding",
       lua_typename(L, tt));
@@ -435,7 +1712,8 @@ static int set_param(lua_State *L, sqlite3_stmt *vm, int param_nr, int arg)
   return rc;
 }
 
-static int raw_readparams_args(lua_State *L, sqlite3_stmt *vm, int arg, int ltop)
+static int raw_readparams_args(lua_State *L, sqlite3_stmt *vm, int arg, int ltop,
+			       sqlite3_destructor_type mode)
 {
   int param_count, param_nr, rc = 0;
 
@@ -445,7 +1723,7 @@ static int raw_readparams_args(lua_State *L, sqlite3_stmt *vm, int arg, int ltop
       param_count, ltop - arg + 1);
 
   for (param_nr=1; param_nr <= param_count; param_nr ++, arg ++) {
-    rc = set_param(L, vm, param_nr, arg);
+    rc = set_param(L, vm, param_nr, arg, mode);
     if (rc)
       break;
   }
@@ -465,26 +1743,144 @@ static int raw_readparams_table(lua_State *L, sqlite3_stmt *vm, int arg)
   lua_pushnil(L);
 
   while (lua_next(L, arg)) {		// [arg]=table, [-2]=key, [-1]=val
-#if defined(lua_isinteger)
-    if (lua_type(L, -2) == LUA_TNUMBER && lua_isinteger(L, -2)) {
+    if (lua_type(L, -2) == LUA_TNUMBER) {
       param_nr = lua_tointeger(L, -2);
     } else {
-#endif
       const char *param_name = lua_tostring(L, -2);
       param_nr = sqlite3_bind_parameter_index(vm, param_name);
       if (param_nr == 0)
         luaL_error(L, LUASQL_PREFIX"binding to invalid parameter name %s\n",
           param_name);
-#if defined(lua_isinteger)
     }
-#endif
-    set_param(L, vm, param_nr, -1);
+    rc = set_param(L, vm, param_nr, -1, SQLITE_TRANSIENT);
     lua_pop(L, 1);
+    if (rc != SQLITE_OK) {
+      lua_pop(L, 1);
+      break;
+    }
   }
 
   return rc;
 }
 
+/*
+** Bind the parameters found from stack index 'arg' on: either one
+** table or positional values.
+** Positional values are bound with the given destructor, values taken
+** from a table are always copied.
+** Return a SQLite result code.
+*/
+static int bind_params(lua_State *L, sqlite3_stmt *vm, int arg,
+		       sqlite3_destructor_type mode)
+{
+  int ltop = lua_gettop(L);
+
+  if (ltop < arg)
+    return SQLITE_OK;
+  if (ltop == arg && lua_type(L, arg) == LUA_TTABLE)
+    return raw_readparams_table(L, vm, arg);
+  return raw_readparams_args(L, vm, arg, ltop, mode);
+}
+
+
+/*
+** Bind the parameters of a vm checked out by conn_prepare_vm, called in
+** protected mode since binding may raise an error.
+** Arguments: the vm (light userdata), whether the values must be copied
+** and the parameters.
+*/
+static int bind_args(lua_State *L)
+{
+  sqlite3_stmt *vm = (sqlite3_stmt *)lua_touserdata(L, 1);
+  sqlite3_destructor_type mode = lua_toboolean(L, 2) ?
+    SQLITE_TRANSIENT : SQLITE_STATIC;
+  lua_pushinteger(L, bind_params(L, vm, 3, mode));
+  return 1;
+}
+
+
+/*
+** Bind the parameters found from stack index 3 on to a vm checked out
+** by conn_prepare_vm.
+** The vm is released before an error raised by the binding is
+** propagated, and when the binding fails.
+** Return 0 in case of success, or push nil and an error message and
+** return 2.
+*/
+static int conn_bind_vm(lua_State *L, conn_data *conn, sqlite3_stmt *vm,
+                        int copy)
+{
+  int top = lua_gettop(L);
+  int i, res;
+
+  luaL_checkstack(L, top + 1, LUASQL_PREFIX"too many parameters");
+  lua_pushcfunction(L, bind_args);
+  lua_pushlightuserdata(L, vm);
+  lua_pushboolean(L, copy);
+  for (i = 3; i <= top; i++)
+    lua_pushvalue(L, i);
+  if (lua_pcall(L, top, 1, 0) != 0)
+    {
+      conn_release_vm(conn, vm);
+      lua_error(L);
+    }
+  res = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  if (res != SQLITE_OK)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+      conn_release_vm(conn, vm);
+      return 2;
+    }
+  return 0;
+}
+
+
+/*
+** Run the first step of a bound vm.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+** 'o' is the stack index of the connection and 's' the stack index of
+** the statement object owning the vm (zero if the vm is not shared).
+*/
+static int step_vm(lua_State *L, int o, conn_data *conn, sqlite3_stmt *vm,
+		   int s)
+{
+  int res;
+  int numcols;
+
+  /* process first result to retrieve query information and type */
+  conn_startbudget(conn);
+  res = sqlite3_step(vm);
+  numcols = sqlite3_column_count(vm);
+
+  /* real query? if empty, must have numcols!=0 */
+  if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols))
+    {
+      return create_cursor(L, o, conn, vm, numcols, s);
+    }
+
+  if (res == SQLITE_DONE) /* and numcols==0, INSERT,UPDATE,DELETE statement */
+    {
+      if (s == 0)
+        conn_release_vm(conn, vm);
+      else
+        sqlite3_reset(vm);
+      /* return number of columns changed */
+      lua_pushnumber(L, sqlite3_changes(conn->sql_conn));
+      return 1;
+    }
+
+  /* error */
+  luasql_faildirect(L, conn_errmsg(conn));
+  if (s == 0)
+    conn_release_vm(conn, vm);
+  else
+    sqlite3_reset(vm);
+  return 2;
+}
+
+
 /*
 ** Execute an SQL statement.
 ** Return a Cursor object if the statement is a query, otherwise
@@ -496,10 +1892,244 @@ static int conn_execute(lua_State *L)
   const char *statement = luaL_checkstring(L, 2);
   int res;
   sqlite3_stmt *vm;
-  const char *errmsg;
-  int numcols;
+
+  res = conn_prepare_vm(conn, statement, &vm);
+  if (res != SQLITE_OK)
+    {
+      return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+    }
+
+  /* Bind parameters (if any): the values stay on the stack until a
+     statement without result columns is done and its bindings are
+     cleared by conn_release_vm, so they need not be copied */
+  if (conn_bind_vm(L, conn, vm, sqlite3_column_count(vm) != 0) != 0)
+    return 2;
+
+  return step_vm(L, 1, conn, vm, 0);
+}
+
+
+/*
+** Bind a row of conn:executemany, called in protected mode since
+** binding may raise an error.
+** Arguments: the vm (light userdata) and the parameter table.
+*/
+static int bind_row(lua_State *L)
+{
+  sqlite3_stmt *vm = (sqlite3_stmt *)lua_touserdata(L, 1);
+  lua_pushinteger(L, raw_readparams_table(L, vm, 2));
+  return 1;
+}
+
+
+/*
+** Abort a conn:executemany: roll the transaction it began back and
+** release its vm.
+** Return nil and the error message on top of the stack.
+*/
+static int executemany_fail(lua_State *L, conn_data *conn, sqlite3_stmt *vm,
+                            int transaction)
+{
+  conn_stopbudget(conn);
+  if (transaction)
+    (void) sqlite3_exec(conn->sql_conn, "ROLLBACK", NULL, NULL, NULL);
+  conn_release_vm(conn, vm);
+  lua_pushnil(L);
+  lua_insert(L, -2);
+  return 2;
+}
+
+
+/*
+** Execute an SQL statement once for each parameter table of an array.
+** The statement is compiled once and only rebound and stepped again for
+** each row; if 'transaction' is true and no transaction is active, all
+** rows are inserted inside a single transaction.
+** Return the total number of tuples affected by the statement.
+*/
+static int conn_executemany(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *statement = luaL_checkstring(L, 2);
+  int transaction = lua_toboolean(L, 4);
+  int res;
+  int i;
+  sqlite3_stmt *vm;
+  double changes = 0;
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  transaction = transaction && sqlite3_get_autocommit(conn->sql_conn);
+
+  res = conn_prepare_vm(conn, statement, &vm);
+  if (res != SQLITE_OK)
+    {
+      return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+    }
+  if (vm == NULL)               /* blanks or comments */
+    return luasql_faildirect(L, "no statement to execute");
+
+  if (transaction
+      && sqlite3_exec(conn->sql_conn, "BEGIN", NULL, NULL, NULL) != SQLITE_OK)
+    {
+      lua_pushstring(L, sqlite3_errmsg(conn->sql_conn));
+      return executemany_fail(L, conn, vm, 0);
+    }
+
+  conn_startbudget(conn);
+  for (i = 1; ; i++)
+    {
+      lua_rawgeti(L, 3, i);
+      if (lua_isnil(L, -1))
+        {
+          lua_pop(L, 1);
+          break;
+        }
+      if (!lua_istable(L, -1))
+        {
+          lua_pop(L, 1);
+          lua_pushfstring(L, LUASQL_PREFIX"row %d is not a table", i);
+          return executemany_fail(L, conn, vm, transaction);
+        }
+
+      sqlite3_clear_bindings(vm);
+      lua_pushcfunction(L, bind_row);
+      lua_pushlightuserdata(L, vm);
+      lua_pushvalue(L, -3);
+      if (lua_pcall(L, 2, 1, 0) != 0)
+        {
+          lua_pushfstring(L, LUASQL_PREFIX"row %d: %s", i, lua_tostring(L, -1));
+          return executemany_fail(L, conn, vm, transaction);
+        }
+      res = (int)lua_tointeger(L, -1);
+      lua_pop(L, 2);
+      if (res == SQLITE_OK)
+        {
+          while ((res = sqlite3_step(vm)) == SQLITE_ROW)
+            ;
+        }
+      if (res != SQLITE_DONE && res != SQLITE_OK)
+        {
+          lua_pushfstring(L, LUASQL_PREFIX"row %d: %s", i,
+                          conn_errmsg(conn));
+          return executemany_fail(L, conn, vm, transaction);
+        }
+      changes += sqlite3_changes(conn->sql_conn);
+      sqlite3_reset(vm);
+    }
+
+  conn_release_vm(conn, vm);
+  if (transaction)
+    {
+      char *errmsg;
+      if (sqlite3_exec(conn->sql_conn, "COMMIT", NULL, NULL, &errmsg) != SQLITE_OK)
+        {
+          lua_pushnil(L);
+          lua_pushliteral(L, LUASQL_PREFIX);
+          lua_pushstring(L, errmsg);
+          sqlite3_free(errmsg);
+          lua_concat(L, 2);
+          (void) sqlite3_exec(conn->sql_conn, "ROLLBACK", NULL, NULL, NULL);
+          return 2;
+        }
+    }
+
+  lua_pushnumber(L, changes);
+  return 1;
+}
+
+
+/*
+** Execute a script of SQL statements, each one run to completion before
+** the next is compiled; rows returned by queries are discarded.
+** Return the total number of tuples affected by the script or, at the
+** first failing statement, nil, an error message and the position
+** (byte offset, starting at 1) of that statement in the script.
+*/
+static int conn_exec_script(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *script = luaL_checkstring(L, 2);
+  const char *statement = script;
+  const char *tail;
+  int changes = sqlite3_total_changes(conn->sql_conn);
+  sqlite3_stmt *vm;
+  int res;
+
+  conn_startbudget(conn);
+  while (*statement != '\0')
+    {
+#if SQLITE_VERSION_NUMBER > 3006013
+      res = sqlite3_prepare_v2(conn->sql_conn, statement, -1, &vm, &tail);
+#else
+      res = sqlite3_prepare(conn->sql_conn, statement, -1, &vm, &tail);
+#endif
+      if (res == SQLITE_OK && vm != NULL)
+        {
+          while ((res = sqlite3_step(vm)) == SQLITE_ROW)
+            ;
+          if (res == SQLITE_DONE)
+            res = SQLITE_OK;
+        }
+      if (res != SQLITE_OK)
+        {
+          luasql_faildirect(L, conn_errmsg(conn));
+          sqlite3_finalize(vm);
+          /* skip the blanks before the statement */
+          while (isspace((unsigned char)*statement))
+            statement++;
+          lua_pushnumber(L, (lua_Number)(statement - script + 1));
+          return 3;
+        }
+      sqlite3_finalize(vm);  /* NULL for comments and blanks */
+      statement = tail;
+    }
+
+  lua_pushnumber(L, sqlite3_total_changes(conn->sql_conn) - changes);
+  return 1;
+}
+
+
+/*
+** Check that the rest of an SQL text holds no other statement, only
+** blanks, comments and semicolons.
+*/
+static int sql_is_blank(sqlite3 *db, const char *sql)
+{
+  sqlite3_stmt *vm;
+  int res;
+
+  while (*sql != '\0')
+    {
+#if SQLITE_VERSION_NUMBER > 3006013
+      res = sqlite3_prepare_v2(db, sql, -1, &vm, &sql);
+#else
+      res = sqlite3_prepare(db, sql, -1, &vm, &sql);
+#endif
+      if (res != SQLITE_OK || vm != NULL)
+        {
+          sqlite3_finalize(vm);
+          return 0;
+        }
+    }
+  return 1;
+}
+
+
+/*
+** Prepare an SQL statement to be executed several times.
+** The text must hold exactly one statement.
+** Return a Statement object.
+*/
+static int conn_prepare(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *statement = luaL_checkstring(L, 2);
+  int res;
+  sqlite3_stmt *vm;
+  stmt_data *stmt;
   const char *tail;
 
+  conn_stopbudget(conn);
 #if SQLITE_VERSION_NUMBER > 3006013
   res = sqlite3_prepare_v2(conn->sql_conn, statement, -1, &vm, &tail);
 #else
@@ -507,47 +2137,1731 @@ static int conn_execute(lua_State *L)
 #endif
   if (res != SQLITE_OK)
     {
-      errmsg = sqlite3_errmsg(conn->sql_conn);
-      return luasql_faildirect(L, errmsg);
+      return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
     }
-
-  /* Bind parameters (if any) */
-  int ltop = lua_gettop(L);
-  if (ltop > 2) {
-    if (ltop == 3 && lua_type(L, 3) == LUA_TTABLE) {
-      res = raw_readparams_table(L, vm, 3);
-    } else if (ltop >= 3) {
-      res = raw_readparams_args(L, vm, 3, ltop);
-    } else {
-      luaL_error(L, LUASQL_PREFIX"parameters are either one table or positional");
+  if (vm == NULL)
+    return luasql_faildirect(L, "no statement to prepare");
+  if (!sql_is_blank(conn->sql_conn, tail))
+    {
+      sqlite3_finalize(vm);
+      return luasql_faildirect(L, "only one statement can be prepared");
     }
-    if (res)
-      return res;
-  }
 
-  /* process first result to retrieve query information and type */
-  res = sqlite3_step(vm);
-  numcols = sqlite3_column_count(vm);
+  stmt = (stmt_data *)LUASQL_NEWUD(L, sizeof(stmt_data));
+  luasql_setmeta(L, LUASQL_STATEMENT_SQLITE);
 
-  /* real query? if empty, must have numcols!=0 */
-  if ((res == SQLITE_ROW) || ((res == SQLITE_DONE) && numcols))
+  /* increment statement count for the connection creating this statement */
+  conn->stmt_counter++;
+
+  /* fill in structure */
+  stmt->closed = 0;
+  stmt->conn = LUA_NOREF;
+  stmt->cur_counter = 0;
+  stmt->conn_data = conn;
+  stmt->sql_vm = vm;
+
+  lua_pushvalue(L, 1);
+  stmt->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Finalizes the vm of a statement and nullify all structure fields.
+*/
+static void stmt_nullify(lua_State *L, stmt_data *stmt)
+{
+  stmt->closed = 1;
+  conn_release(stmt->conn_data, DEFER_FINALIZE, stmt->sql_vm);
+  stmt->sql_vm = NULL;
+  /* Decrement statement counter on connection object */
+  stmt->conn_data->stmt_counter--;
+  luaL_unref(L, LUA_REGISTRYINDEX, stmt->conn);
+}
+
+
+/*
+** Statement object collector function
+*/
+static int stmt_gc(lua_State *L)
+{
+  stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT_SQLITE);
+  if (stmt != NULL && !(stmt->closed))
+    stmt_nullify(L, stmt);
+  return 0;
+}
+
+
+/*
+** Close a Statement object.
+*/
+static int stmt_close(lua_State *L)
+{
+  stmt_data *stmt = (stmt_data *)luaL_checkudata(L, 1, LUASQL_STATEMENT_SQLITE);
+  luaL_argcheck(L, stmt != NULL, 1, LUASQL_PREFIX"statement expected");
+  if (stmt->closed)
+  {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "Statement is already closed");
+    return 2;
+  }
+  if (conn_closepending(L, stmt->conn_data))
+    return 2;
+
+  if (stmt->cur_counter > 0)
+  {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "There are open cursors");
+    return 2;
+  }
+
+  stmt_nullify(L, stmt);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Reset a Statement object and clear its parameter bindings.
+*/
+static int stmt_reset(lua_State *L)
+{
+  stmt_data *stmt = getstatement(L);
+  if (stmt->cur_counter > 0)
+  {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "There are open cursors");
+    return 2;
+  }
+
+  sqlite3_reset(stmt->sql_vm);
+  sqlite3_clear_bindings(stmt->sql_vm);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Execute a prepared statement with the given parameters.
+** Return a Cursor object if the statement is a query, otherwise
+** return the number of tuples affected by the statement.
+*/
+static int stmt_execute(lua_State *L)
+{
+  stmt_data *stmt = getstatement(L);
+  conn_data *conn = stmt->conn_data;
+  luaL_argcheck(L, stmt->cur_counter == 0, 1,
+		LUASQL_PREFIX"there are still open cursors");
+
+  /* errors from a previous execution were already reported */
+  sqlite3_reset(stmt->sql_vm);
+  /* parameters not given now are NULL, not the previous values */
+  sqlite3_clear_bindings(stmt->sql_vm);
+
+  /* Bind parameters (if any) */
+  if (bind_params(L, stmt->sql_vm, 2, SQLITE_TRANSIENT) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, stmt->conn);
+  return step_vm(L, lua_gettop(L), conn, stmt->sql_vm, 1);
+}
+
+
+/*
+** Return the number of parameters of a Statement object.
+*/
+static int stmt_getparamcount(lua_State *L)
+{
+  stmt_data *stmt = getstatement(L);
+  lua_pushnumber(L, sqlite3_bind_parameter_count(stmt->sql_vm));
+  return 1;
+}
+
+
+/*
+** Open a handle for incremental I/O on a BLOB value.
+** Return a Blob object.
+*/
+static int conn_openblob(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *db = luaL_checkstring(L, 2);
+  const char *table = luaL_checkstring(L, 3);
+  const char *column = luaL_checkstring(L, 4);
+  sqlite3_int64 rowid = (sqlite3_int64)luaL_checknumber(L, 5);
+  int writable = lua_toboolean(L, 6);
+  sqlite3_blob *handle;
+  blob_data *blob;
+
+  conn_stopbudget(conn);
+  if (sqlite3_blob_open(conn->sql_conn, db, table, column, rowid, writable,
+                        &handle) != SQLITE_OK)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+      sqlite3_blob_close(handle);
+      return 2;
+    }
+
+  blob = (blob_data *)LUASQL_NEWUD(L, sizeof(blob_data));
+  luasql_setmeta(L, LUASQL_BLOB_SQLITE);
+
+  /* increment blob count for the connection creating this blob */
+  conn->blob_counter++;
+
+  /* fill in structure */
+  blob->closed = 0;
+  blob->conn = LUA_NOREF;
+  blob->conn_data = conn;
+  blob->blob = handle;
+
+  lua_pushvalue(L, 1);
+  blob->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Nullify all structure fields of a blob whose handle was closed.
+*/
+static void blob_nullify(lua_State *L, blob_data *blob)
+{
+  blob->closed = 1;
+  blob->blob = NULL;
+  /* Decrement blob counter on connection object */
+  blob->conn_data->blob_counter--;
+  luaL_unref(L, LUA_REGISTRYINDEX, blob->conn);
+}
+
+
+/*
+** Blob object collector function
+*/
+static int blob_gc(lua_State *L)
+{
+  blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUASQL_BLOB_SQLITE);
+  if (blob != NULL && !(blob->closed))
+    {
+      conn_release(blob->conn_data, DEFER_BLOB, blob->blob);
+      blob_nullify(L, blob);
+    }
+  return 0;
+}
+
+
+/*
+** Close a Blob object.
+*/
+static int blob_close(lua_State *L)
+{
+  int ret = 1;
+  blob_data *blob = (blob_data *)luaL_checkudata(L, 1, LUASQL_BLOB_SQLITE);
+  luaL_argcheck(L, blob != NULL, 1, LUASQL_PREFIX"blob expected");
+  if (blob->closed)
+  {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "Blob is already closed");
+    return 2;
+  }
+  if (conn_closepending(L, blob->conn_data))
+    return 2;
+
+  if (sqlite3_blob_close(blob->blob) != SQLITE_OK)
+    ret = luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+  else
+    lua_pushboolean(L, 1);
+  blob_nullify(L, blob);
+  return ret;
+}
+
+
+/*
+** Read up to n bytes of the blob starting at the given (zero based)
+** offset.
+** Return a string, empty when the offset is at the end of the blob.
+*/
+static int blob_read(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  int offset = (int)luaL_checknumber(L, 2);
+  int n = (int)luaL_checknumber(L, 3);
+  int size = sqlite3_blob_bytes(blob->blob);
+  luaL_Buffer b;
+  char *buffer;
+
+  luaL_argcheck(L, offset >= 0 && offset <= size, 2,
+                LUASQL_PREFIX"offset out of range");
+  luaL_argcheck(L, n >= 0, 3, LUASQL_PREFIX"invalid number of bytes");
+  if (n > size - offset)
+    n = size - offset;
+  if (n == 0)
+    {
+      lua_pushliteral(L, "");
+      return 1;
+    }
+
+#if !defined(LUA_VERSION_NUM) || (LUA_VERSION_NUM == 501)
+  /* Lua 5.0 and 5.1: read one buffer at a time */
+  luaL_buffinit(L, &b);
+  while (n > 0)
+    {
+      int len = n > LUAL_BUFFERSIZE ? LUAL_BUFFERSIZE : n;
+      buffer = luaL_prepbuffer(&b);
+      if (sqlite3_blob_read(blob->blob, buffer, len, offset) != SQLITE_OK)
+        return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+      luaL_addsize(&b, len);
+      offset += len;
+      n -= len;
+    }
+  luaL_pushresult(&b);
+#else
+  buffer = luaL_buffinitsize(L, &b, n);
+  if (sqlite3_blob_read(blob->blob, buffer, n, offset) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+  luaL_pushresultsize(&b, n);
+#endif
+  return 1;
+}
+
+
+/*
+** Write the given string to the blob starting at the given (zero
+** based) offset.  The size of the blob cannot be changed.
+*/
+static int blob_write(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  int offset = (int)luaL_checknumber(L, 2);
+  size_t len;
+  const char *data = luaL_checklstring(L, 3, &len);
+
+  luaL_argcheck(L, offset >= 0, 2, LUASQL_PREFIX"offset out of range");
+  if (sqlite3_blob_write(blob->blob, data, (int)len, offset) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return the size of the blob in bytes.
+*/
+static int blob_size(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  lua_pushnumber(L, sqlite3_blob_bytes(blob->blob));
+  return 1;
+}
+
+
+/*
+** Move the blob handle to the same column of another row.
+*/
+static int blob_reopen(lua_State *L)
+{
+  blob_data *blob = getblob(L);
+  sqlite3_int64 rowid = (sqlite3_int64)luaL_checknumber(L, 2);
+
+  conn_stopbudget(blob->conn_data);
+  if (sqlite3_blob_reopen(blob->blob, rowid) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(blob->conn_data->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Start an online backup of the main database of the connection to
+** another connection or to the database file of the given path.
+** Return a Backup object, which copies 'pages' pages on each step
+** (all of them if omitted).
+*/
+static int conn_backup(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int pages = (int)luaL_optnumber(L, 3, -1);
+  conn_data *dest = NULL;
+  sqlite3 *dest_db;
+  sqlite3_backup *backup;
+  backup_data *bk;
+
+  if (lua_isuserdata(L, 2))
+    {
+      dest = (conn_data *)luaL_checkudata(L, 2, LUASQL_CONNECTION_SQLITE);
+      luaL_argcheck(L, !dest->closed, 2, LUASQL_PREFIX"connection is closed");
+      dest_db = dest->sql_conn;
+    }
+  else
+    {
+      const char *path = luaL_checkstring(L, 2);
+#if SQLITE_VERSION_NUMBER > 3006013
+      int res = sqlite3_open_v2(path, &dest_db,
+                                SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+#else
+      int res = sqlite3_open(path, &dest_db);
+#endif
+      if (res != SQLITE_OK)
+        {
+          luasql_faildirect(L, sqlite3_errmsg(dest_db));
+          sqlite3_close(dest_db);
+          return 2;
+        }
+    }
+
+  backup = sqlite3_backup_init(dest_db, "main", conn->sql_conn, "main");
+  if (backup == NULL)
+    {
+      luasql_faildirect(L, sqlite3_errmsg(dest_db));
+      if (dest == NULL)
+        sqlite3_close(dest_db);
+      return 2;
+    }
+
+  bk = (backup_data *)LUASQL_NEWUD(L, sizeof(backup_data));
+  luasql_setmeta(L, LUASQL_BACKUP_SQLITE);
+
+  /* both connections are busy until the backup is finished */
+  conn->backup_counter++;
+  if (dest != NULL)
+    dest->backup_counter++;
+
+  /* fill in structure */
+  bk->closed = 0;
+  bk->conn = LUA_NOREF;
+  bk->dest = LUA_NOREF;
+  bk->conn_data = conn;
+  bk->dest_data = dest;
+  bk->dest_db = dest_db;
+  bk->pages = pages;
+  bk->backup = backup;
+
+  lua_pushvalue(L, 1);
+  bk->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  if (dest != NULL)
+    {
+      lua_pushvalue(L, 2);
+      bk->dest = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  return 1;
+}
+
+
+/*
+** Nullify all structure fields of a backup whose handle was finished.
+*/
+static void backup_nullify(lua_State *L, backup_data *bk)
+{
+  if (bk->dest_data != NULL)
+    bk->dest_data->backup_counter--;
+  bk->conn_data->backup_counter--;
+
+  bk->closed = 1;
+  bk->backup = NULL;
+  bk->dest_db = NULL;
+  luaL_unref(L, LUA_REGISTRYINDEX, bk->conn);
+  luaL_unref(L, LUA_REGISTRYINDEX, bk->dest);
+}
+
+
+/*
+** Finish the backup and nullify all structure fields.
+** Return the result of sqlite3_backup_finish; in case of error, its
+** message is pushed on the stack.
+*/
+static int backup_finish(lua_State *L, backup_data *bk)
+{
+  int res = sqlite3_backup_finish(bk->backup);
+
+  if (res != SQLITE_OK)
+    luasql_faildirect(L, sqlite3_errmsg(bk->dest_db));
+  if (bk->dest_data == NULL)
+    sqlite3_close(bk->dest_db);
+  backup_nullify(L, bk);
+  return res;
+}
+
+
+/*
+** Copy up to n pages (the number given to conn:backup by default).
+** Return true when the backup is complete (the Backup object is then
+** closed), otherwise false followed by the number of pages still to be
+** copied and the total number of pages.
+*/
+static int backup_step(lua_State *L)
+{
+  backup_data *bk = getbackup(L);
+  int pages = (int)luaL_optnumber(L, 2, bk->pages);
+  int res = sqlite3_backup_step(bk->backup, pages);
+
+  switch (res) {
+    case SQLITE_DONE:
+      if (backup_finish(L, bk) != SQLITE_OK)
+        return 2;
+      lua_pushboolean(L, 1);
+      return 1;
+
+    case SQLITE_OK:
+    case SQLITE_BUSY:
+    case SQLITE_LOCKED:
+      lua_pushboolean(L, 0);
+      lua_pushnumber(L, sqlite3_backup_remaining(bk->backup));
+      lua_pushnumber(L, sqlite3_backup_pagecount(bk->backup));
+      return 3;
+
+    default:
+      /* sqlite3_backup_finish reports the error of the failed step */
+      if (backup_finish(L, bk) == SQLITE_OK)
+        luasql_faildirect(L, sqlite3_errstr(res));
+      return 2;
+  }
+}
+
+
+/*
+** Backup object collector function
+*/
+static int backup_gc(lua_State *L)
+{
+  backup_data *bk = (backup_data *)luaL_checkudata(L, 1, LUASQL_BACKUP_SQLITE);
+  if (bk != NULL && !(bk->closed))
+    {
+      /* release it with the connection running a query, if any */
+      conn_data *conn = bk->conn_data;
+      if (conn->async == NULL && bk->dest_data != NULL)
+        conn = bk->dest_data;
+      conn_release(conn, DEFER_BACKUP, bk->backup);
+      if (bk->dest_data == NULL)
+        conn_release(conn, DEFER_CLOSE, bk->dest_db);
+      backup_nullify(L, bk);
+    }
+  return 0;
+}
+
+
+/*
+** Close a Backup object, abandoning an unfinished backup.
+*/
+static int backup_close(lua_State *L)
+{
+  backup_data *bk = (backup_data *)luaL_checkudata(L, 1, LUASQL_BACKUP_SQLITE);
+  luaL_argcheck(L, bk != NULL, 1, LUASQL_PREFIX"backup expected");
+  if (bk->closed)
+  {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, "Backup is already closed");
+    return 2;
+  }
+  if (conn_closepending(L, bk->conn_data)
+      || (bk->dest_data != NULL && conn_closepending(L, bk->dest_data)))
+    return 2;
+
+  if (backup_finish(L, bk) != SQLITE_OK)
+    return 2;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+#if SQLITE_VERSION_NUMBER >= 3036000
+/*
+** Return the image of a database of the connection as a string.
+*/
+static int conn_serialize(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *schema = luaL_optstring(L, 2, "main");
+  sqlite3_int64 size;
+  unsigned char *data = sqlite3_serialize(conn->sql_conn, schema, &size, 0);
+
+  if (data == NULL)
+    return luasql_faildirect(L, "could not serialize the database");
+  lua_pushlstring(L, (const char *)data, (size_t)size);
+  sqlite3_free(data);
+  return 1;
+}
+
+
+/*
+** Replace a database of the connection by the in-memory image given
+** as a string.
+*/
+static int conn_deserialize(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  size_t size;
+  const char *image = luaL_checklstring(L, 2, &size);
+  const char *schema = luaL_optstring(L, 3, "main");
+  unsigned char *data = (unsigned char *)sqlite3_malloc64(size);
+
+  if (data == NULL)
+    return luasql_faildirect(L, "could not allocate the database image");
+  memcpy(data, image, size);
+  /* the image is freed by SQLite, even in case of error */
+  if (sqlite3_deserialize(conn->sql_conn, schema, data, size, size,
+                          SQLITE_DESERIALIZE_FREEONCLOSE |
+                          SQLITE_DESERIALIZE_RESIZEABLE) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  lua_pushboolean(L, 1);
+  return 1;
+}
+#endif
+
+
+/*
+** Set the result of an SQL function from the value at stack index 'idx'.
+** Supported are the data types nil, string, boolean, number, as in
+** set_param.
+*/
+static void set_result(lua_State *L, sqlite3_context *ctx, int idx)
+{
+  switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+      sqlite3_result_null(ctx);
+      break;
+
+    case LUA_TSTRING: {
+      size_t s_len;
+      const char *s = lua_tolstring(L, idx, &s_len);
+      sqlite3_result_text(ctx, s, s_len, SQLITE_TRANSIENT);
+      break;
+    }
+
+    case LUA_TBOOLEAN:
+      sqlite3_result_int(ctx, lua_toboolean(L, idx));
+      break;
+
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+      if (lua_isinteger(L, idx))
+        sqlite3_result_int64(ctx, lua_tointeger(L, idx));
+      else
+#endif
+        sqlite3_result_double(ctx, lua_tonumber(L, idx));
+      break;
+
+    default:
+      sqlite3_result_error(ctx, LUASQL_PREFIX"unhandled data type in function result", -1);
+      break;
+  }
+}
+
+
+/*
+** Push the function referenced by 'fn' and the arguments of the call on
+** the thread of the function.
+** Return 0 if there is not enough stack space.
+*/
+static int push_call(lua_State *L, sqlite3_context *ctx, int fn, int argc,
+		     sqlite3_value **argv)
+{
+  int i;
+
+  if (!lua_checkstack(L, argc + 2))
+    {
+      sqlite3_result_error(ctx, LUASQL_PREFIX"too many arguments", -1);
+      return 0;
+    }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, fn);
+  for (i = 0; i < argc; i++)
+    push_value(L, argv[i]);
+  return 1;
+}
+
+
+/*
+** Call a Lua function in protected mode, reporting its errors to SQLite.
+** Return 0 in case of error, leaving the stack balanced.
+*/
+static int call_function(lua_State *L, sqlite3_context *ctx, int nargs)
+{
+  if (lua_pcall(L, nargs, 1, 0) != 0)
+    {
+      sqlite3_result_error(ctx, lua_tostring(L, -1), -1);
+      lua_pop(L, 1);
+      return 0;
+    }
+  return 1;
+}
+
+
+/*
+** Implementation of a scalar SQL function.
+*/
+static void func_scalar(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  func_data *fd = (func_data *)sqlite3_user_data(ctx);
+  lua_State *L = fd->L;
+
+  if (!push_call(L, ctx, fd->fn, argc, argv))
+    return;
+  if (call_function(L, ctx, argc))
+    {
+      set_result(L, ctx, -1);
+      lua_pop(L, 1);
+    }
+}
+
+
+/*
+** Step of an aggregate SQL function: the step function receives the
+** current state of the group (nil at first) followed by the arguments,
+** and returns the new state.
+*/
+static void func_step(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  func_data *fd = (func_data *)sqlite3_user_data(ctx);
+  lua_State *L = fd->L;
+  aggr_data *aggr = (aggr_data *)sqlite3_aggregate_context(ctx, sizeof(aggr_data));
+
+  if (aggr == NULL)
+    {
+      sqlite3_result_error_nomem(ctx);
+      return;
+    }
+  if (!aggr->initialized)
+    {
+      aggr->initialized = 1;
+      aggr->ref = LUA_NOREF;
+    }
+
+  if (!push_call(L, ctx, fd->fn, argc, argv))
+    return;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, aggr->ref);
+  lua_insert(L, -argc - 1);
+  if (call_function(L, ctx, argc + 1))
+    {
+      luaL_unref(L, LUA_REGISTRYINDEX, aggr->ref);
+      aggr->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+}
+
+
+/*
+** Final of an aggregate SQL function: the final function receives the
+** state of the group and returns the result.
+*/
+static void func_final(sqlite3_context *ctx)
+{
+  func_data *fd = (func_data *)sqlite3_user_data(ctx);
+  lua_State *L = fd->L;
+  aggr_data *aggr = (aggr_data *)sqlite3_aggregate_context(ctx, 0);
+  int ref = (aggr != NULL && aggr->initialized) ? aggr->ref : LUA_NOREF;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, fd->final);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+  luaL_unref(L, LUA_REGISTRYINDEX, ref);
+  if (call_function(L, ctx, 1))
+    {
+      set_result(L, ctx, -1);
+      lua_pop(L, 1);
+    }
+}
+
+
+/*
+** Release a registered function, called by SQLite when the function is
+** replaced or the connection is closed.
+*/
+static void func_destroy(void *p)
+{
+  func_data *fd = (func_data *)p;
+  luaL_unref(fd->L, LUA_REGISTRYINDEX, fd->fn);
+  luaL_unref(fd->L, LUA_REGISTRYINDEX, fd->final);
+  conn_releasefuncthread(fd->L, fd->conn);
+  free(fd);
+}
+
+
+/*
+** Register an SQL function implemented by the Lua functions at stack
+** indices 'fn' and 'final' (zero for a scalar function).
+** The options string may contain 'd' (deterministic), 'i' (innocuous)
+** and 'o' (direct only).
+*/
+static int create_function(lua_State *L, conn_data *conn, int fn, int final,
+			   const char *opts)
+{
+  const char *name = luaL_checkstring(L, 2);
+  int nargs = (int)luaL_checknumber(L, 3);
+  int flags = SQLITE_UTF8;
+  func_data *fd;
+  int res;
+
+#ifdef SQLITE_DETERMINISTIC
+  if (strchr(opts, 'd') != NULL)
+    flags |= SQLITE_DETERMINISTIC;
+#endif
+#ifdef SQLITE_INNOCUOUS
+  if (strchr(opts, 'i') != NULL)
+    flags |= SQLITE_INNOCUOUS;
+  if (strchr(opts, 'o') != NULL)
+    flags |= SQLITE_DIRECTONLY;
+#endif
+
+  fd = (func_data *)malloc(sizeof(func_data));
+  if (fd == NULL)
+    return luasql_faildirect(L, "could not allocate the function data");
+  fd->L = conn_functhread(L, conn);
+  fd->conn = conn;
+  lua_pushvalue(L, fn);
+  fd->fn = luaL_ref(L, LUA_REGISTRYINDEX);
+  fd->final = LUA_NOREF;
+  if (final != 0)
+    {
+      lua_pushvalue(L, final);
+      fd->final = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+  /* on failure, func_destroy has already been called */
+  if (final == 0)
+    res = sqlite3_create_function_v2(conn->sql_conn, name, nargs, flags, fd,
+				     func_scalar, NULL, NULL, func_destroy);
+  else
+    res = sqlite3_create_function_v2(conn->sql_conn, name, nargs, flags, fd,
+				     NULL, func_step, func_final, func_destroy);
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Register a scalar SQL function implemented by a Lua function.
+*/
+static int conn_createfunction(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  luaL_checktype(L, 4, LUA_TFUNCTION);
+  return create_function(L, conn, 4, 0, luaL_optstring(L, 5, ""));
+}
+
+
+/*
+** Register an aggregate SQL function implemented by a pair of Lua
+** functions: step and final.
+*/
+static int conn_createaggregate(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  luaL_checktype(L, 4, LUA_TFUNCTION);
+  luaL_checktype(L, 5, LUA_TFUNCTION);
+  return create_function(L, conn, 4, 5, luaL_optstring(L, 6, ""));
+}
+
+
+#if SQLITE_VERSION_NUMBER >= 3009000
+/*
+** Return the number of rows of a columnar provider: its field 'count'
+** or the length of the array of the first column.
+*/
+static sqlite3_int64 module_count(module_data *mod)
+{
+  lua_State *L = mod->L;
+  sqlite3_int64 count;
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mod->provider);
+  lua_pushliteral(L, "count");
+  lua_rawget(L, -2);
+  if (lua_type(L, -1) == LUA_TNUMBER)
+    count = (sqlite3_int64)lua_tonumber(L, -1);
+  else
+    {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, mod->columns[0]);
+      count = (sqlite3_int64)luasql_rawlen(L, -1);
+      lua_pop(L, 1);
+    }
+  lua_pop(L, 2);
+  return count;
+}
+
+
+/*
+** Build the lookup table of the indexed column of a columnar provider,
+** mapping each value to the list of its rows.
+** Booleans are keyed by the integers reported to SQLite for them, and
+** NaN, which SQLite reports as NULL, is left out.
+** Called in protected mode with the module as a light userdata; return
+** the lookup table.
+*/
+static int module_buildindex(lua_State *L)
+{
+  module_data *mod = (module_data *)lua_touserdata(L, 1);
+  sqlite3_int64 count = module_count(mod);
+  sqlite3_int64 r;
+
+  lua_newtable(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, mod->columns[mod->index_col]);
+  for (r = 1; r <= count; r++)
+    {
+      lua_rawgeti(L, 3, (int)r);
+      if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER
+                               && lua_tonumber(L, -1) != lua_tonumber(L, -1)))
+        {
+          lua_pop(L, 1);
+          continue;
+        }
+      if (lua_type(L, -1) == LUA_TBOOLEAN)
+        {
+          int b = lua_toboolean(L, -1);
+          lua_pop(L, 1);
+          lua_pushinteger(L, b);
+        }
+      lua_pushvalue(L, -1);
+      lua_rawget(L, 2);
+      if (lua_isnil(L, -1))
+        {
+          lua_pop(L, 1);
+          lua_newtable(L);
+          lua_pushvalue(L, -2);
+          lua_pushvalue(L, -2);
+          lua_rawset(L, 2);
+        }
+      lua_pushnumber(L, (lua_Number)r);
+      lua_rawseti(L, -2, (int)luasql_rawlen(L, -2) + 1);
+      lua_pop(L, 2);
+    }
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/*
+** Release a module, called by SQLite when the module is replaced or the
+** connection is closed.
+*/
+static void module_destroy(void *p)
+{
+  module_data *mod = (module_data *)p;
+  int i;
+
+  if (mod->columns != NULL)
+    for (i = 0; i < mod->ncols; i++)
+      luaL_unref(mod->L, LUA_REGISTRYINDEX, mod->columns[i]);
+  luaL_unref(mod->L, LUA_REGISTRYINDEX, mod->provider);
+  luaL_unref(mod->L, LUA_REGISTRYINDEX, mod->rows);
+  sqlite3_free(mod->schema);
+  free(mod->columns);
+  conn_releasefuncthread(mod->L, mod->conn);
+  free(mod);
+}
+
+
+/*
+** Report the error message on top of the stack of the module thread.
+*/
+static int vtab_error(sqlite3_vtab *vtab, lua_State *L)
+{
+  sqlite3_free(vtab->zErrMsg);
+  vtab->zErrMsg = sqlite3_mprintf("%s", lua_tostring(L, -1));
+  lua_pop(L, 1);
+  return SQLITE_ERROR;
+}
+
+
+static int vtab_connect(sqlite3 *db, void *aux, int argc,
+			const char *const *argv, sqlite3_vtab **vtab,
+			char **err)
+{
+  module_data *mod = (module_data *)aux;
+  vtab_data *v;
+  int res;
+
+  (void)argc; (void)argv; (void)err;
+  res = sqlite3_declare_vtab(db, mod->schema);
+  if (res != SQLITE_OK)
+    return res;
+  v = (vtab_data *)sqlite3_malloc(sizeof(vtab_data));
+  if (v == NULL)
+    return SQLITE_NOMEM;
+  memset(v, 0, sizeof(vtab_data));
+  v->module = mod;
+  *vtab = &v->base;
+  return SQLITE_OK;
+}
+
+
+static int vtab_disconnect(sqlite3_vtab *vtab)
+{
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+
+/*
+** Use an equality constraint on the indexed column, if any.
+** SQLite still checks the constraint on the rows found: lookups compare
+** values as Lua does, without SQL affinities or the distinction between
+** text and blobs, and rows functions may ignore the constraint.
+*/
+static int vtab_bestindex(sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+  module_data *mod = ((vtab_data *)vtab)->module;
+  int i;
+
+  info->idxNum = 0;
+  info->estimatedCost = 1e6;
+  if (mod->index_col < 0)
+    return SQLITE_OK;
+  for (i = 0; i < info->nConstraint; i++)
+    {
+      const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+      if (c->usable && c->iColumn == mod->index_col
+	  && c->op == SQLITE_INDEX_CONSTRAINT_EQ)
+	{
+#if SQLITE_VERSION_NUMBER >= 3022000
+	  /* lookups compare values as they are */
+	  if (strcmp(sqlite3_vtab_collation(info, i), "BINARY") != 0)
+	    continue;
+#endif
+	  info->aConstraintUsage[i].argvIndex = 1;
+	  info->idxNum = 1;
+	  info->estimatedCost = 10;
+	  info->estimatedRows = 10;
+	  break;
+	}
+    }
+  return SQLITE_OK;
+}
+
+
+static int vcursor_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor)
+{
+  vcursor_data *cur = (vcursor_data *)sqlite3_malloc(sizeof(vcursor_data));
+  (void)vtab;
+  if (cur == NULL)
+    return SQLITE_NOMEM;
+  memset(cur, 0, sizeof(vcursor_data));
+  cur->index = LUA_NOREF;
+  cur->matches = LUA_NOREF;
+  cur->iter = LUA_NOREF;
+  cur->row = LUA_NOREF;
+  *cursor = &cur->base;
+  return SQLITE_OK;
+}
+
+
+/*
+** Release the Lua values of a scan.
+*/
+static void vcursor_reset(lua_State *L, vcursor_data *cur)
+{
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->matches);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->iter);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->row);
+  cur->matches = LUA_NOREF;
+  cur->iter = LUA_NOREF;
+  cur->row = LUA_NOREF;
+  cur->rowid = 0;
+  cur->match = 0;
+  cur->eof = 0;
+}
+
+
+static int vcursor_close(sqlite3_vtab_cursor *cursor)
+{
+  vcursor_data *cur = (vcursor_data *)cursor;
+  lua_State *L = ((vtab_data *)cursor->pVtab)->module->L;
+  vcursor_reset(L, cur);
+  luaL_unref(L, LUA_REGISTRYINDEX, cur->index);
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+
+static int vcursor_next(sqlite3_vtab_cursor *cursor)
+{
+  vcursor_data *cur = (vcursor_data *)cursor;
+  module_data *mod = ((vtab_data *)cursor->pVtab)->module;
+  lua_State *L = mod->L;
+
+  if (mod->columns == NULL)
+    {
+      /* rows function: call the iterator */
+      lua_rawgeti(L, LUA_REGISTRYINDEX, cur->iter);
+      if (lua_pcall(L, 0, 1, 0) != 0)
+	return vtab_error(cursor->pVtab, L);
+      if (lua_isnil(L, -1))
+	{
+	  lua_pop(L, 1);
+	  cur->eof = 1;
+	  return SQLITE_OK;
+	}
+      if (!lua_istable(L, -1))
+	{
+	  lua_pop(L, 1);
+	  lua_pushliteral(L, LUASQL_PREFIX"rows must be tables");
+	  return vtab_error(cursor->pVtab, L);
+	}
+      luaL_unref(L, LUA_REGISTRYINDEX, cur->row);
+      cur->row = luaL_ref(L, LUA_REGISTRYINDEX);
+      cur->rowid++;
+    }
+  else if (cur->matches != LUA_NOREF)
+    {
+      /* equality lookup: next matching row */
+      lua_rawgeti(L, LUA_REGISTRYINDEX, cur->matches);
+      lua_rawgeti(L, -1, (int)++cur->match);
+      if (lua_isnil(L, -1))
+	cur->eof = 1;
+      else
+	cur->rowid = (sqlite3_int64)lua_tonumber(L, -1);
+      lua_pop(L, 2);
+    }
+  else
+    cur->eof = ++cur->rowid > cur->count;
+  return SQLITE_OK;
+}
+
+
+static int vcursor_filter(sqlite3_vtab_cursor *cursor, int idxnum,
+			  const char *idxstr, int argc, sqlite3_value **argv)
+{
+  vcursor_data *cur = (vcursor_data *)cursor;
+  module_data *mod = ((vtab_data *)cursor->pVtab)->module;
+  lua_State *L = mod->L;
+
+  (void)idxstr; (void)argc;
+  vcursor_reset(L, cur);
+  if (mod->columns == NULL)
+    {
+      /* rows function: get an iterator, passing the equality constraint */
+      lua_rawgeti(L, LUA_REGISTRYINDEX, mod->rows);
+      if (idxnum == 1)
+	{
+	  lua_rawgeti(L, LUA_REGISTRYINDEX, mod->provider);
+	  lua_pushliteral(L, "index");
+	  lua_rawget(L, -2);
+	  lua_remove(L, -2);
+	  push_value(L, argv[0]);
+	}
+      if (lua_pcall(L, idxnum == 1 ? 2 : 0, 1, 0) != 0)
+	return vtab_error(cursor->pVtab, L);
+      if (!lua_isfunction(L, -1))
+	{
+	  lua_pop(L, 1);
+	  lua_pushliteral(L, LUASQL_PREFIX"rows must return an iterator");
+	  return vtab_error(cursor->pVtab, L);
+	}
+      cur->iter = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  else if (idxnum == 1)
+    {
+      /* columnar provider: look the value up; the lookup table is
+	 built for each cursor, so it sees the data as it is when the
+	 statement runs, and kept for the lookups of that run */
+      if (cur->index == LUA_NOREF)
+	{
+	  lua_pushcfunction(L, module_buildindex);
+	  lua_pushlightuserdata(L, mod);
+	  if (lua_pcall(L, 1, 1, 0) != 0)
+	    return vtab_error(cursor->pVtab, L);
+	  cur->index = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+      lua_rawgeti(L, LUA_REGISTRYINDEX, cur->index);
+      push_value(L, argv[0]);
+      lua_rawget(L, -2);
+      if (lua_isnil(L, -1))
+	{
+	  lua_pop(L, 2);
+	  cur->eof = 1;
+	  return SQLITE_OK;
+	}
+      cur->matches = luaL_ref(L, LUA_REGISTRYINDEX);
+      lua_pop(L, 1);
+    }
+  else
+    cur->count = module_count(mod);
+  return vcursor_next(cursor);
+}
+
+
+static int vcursor_eof(sqlite3_vtab_cursor *cursor)
+{
+  return ((vcursor_data *)cursor)->eof;
+}
+
+
+static int vcursor_column(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx,
+			  int i)
+{
+  vcursor_data *cur = (vcursor_data *)cursor;
+  module_data *mod = ((vtab_data *)cursor->pVtab)->module;
+  lua_State *L = mod->L;
+
+  if (mod->columns == NULL)
+    {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, cur->row);
+      lua_rawgeti(L, -1, i + 1);
+    }
+  else
+    {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, mod->columns[i]);
+      lua_rawgeti(L, -1, (int)cur->rowid);
+    }
+  set_result(L, ctx, -1);
+  lua_pop(L, 2);
+  return SQLITE_OK;
+}
+
+
+static int vcursor_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid)
+{
+  *rowid = ((vcursor_data *)cursor)->rowid;
+  return SQLITE_OK;
+}
+
+
+/* Read-only, eponymous-only module: the table exists without CREATE */
+static sqlite3_module lua_module = {
+  0,                  /* iVersion: the methods of later versions are NULL */
+  NULL,               /* xCreate */
+  vtab_connect,
+  vtab_bestindex,
+  vtab_disconnect,
+  vtab_disconnect,    /* xDestroy */
+  vcursor_open,
+  vcursor_close,
+  vcursor_filter,
+  vcursor_next,
+  vcursor_eof,
+  vcursor_column,
+  vcursor_rowid,
+  NULL,               /* xUpdate */
+  NULL,               /* xBegin */
+  NULL,               /* xSync */
+  NULL,               /* xCommit */
+  NULL,               /* xRollback */
+  NULL,               /* xFindFunction */
+  NULL,               /* xRename */
+  NULL,               /* xSavepoint */
+  NULL,               /* xRelease */
+  NULL,               /* xRollbackTo */
+#if SQLITE_VERSION_NUMBER >= 3026000
+  NULL,               /* xShadowName */
+#endif
+#if SQLITE_VERSION_NUMBER >= 3044000
+  NULL,               /* xIntegrity */
+#endif
+};
+
+
+/*
+** Register a read-only virtual table named 'name', whose rows come from
+** a Lua provider table with the fields:
+**   columns: list of column names;
+**   data: table with an array of values for each column name, or
+**   rows: function returning an iterator of rows (arrays of values);
+**   count: number of rows of the data arrays (optional);
+**   index: name of a column whose equality constraints are pushed down
+**     to a lookup table (data) or to the rows function (optional).
+** The provider is used in place: no data is copied into SQLite.
+*/
+static int conn_createmodule(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *name = luaL_checkstring(L, 2);
+  int columns, data, rows, index;
+  int ncols, i;
+  module_data *mod;
+
+  luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 3);
+  lua_getfield(L, 3, "columns");
+  lua_getfield(L, 3, "data");
+  lua_getfield(L, 3, "rows");
+  lua_getfield(L, 3, "index");
+  columns = 4; data = 5; rows = 6; index = 7;
+  luaL_argcheck(L, lua_istable(L, columns), 3,
+		LUASQL_PREFIX"provider must have a list of columns");
+  luaL_argcheck(L, lua_istable(L, data) || lua_isfunction(L, rows), 3,
+		LUASQL_PREFIX"provider must have data arrays or a rows function");
+  ncols = (int)luasql_rawlen(L, columns);
+  luaL_argcheck(L, ncols > 0, 3, LUASQL_PREFIX"provider must have a list of columns");
+
+  /* check everything before allocating */
+  for (i = 1; i <= ncols; i++)
+    {
+      lua_rawgeti(L, columns, i);
+      luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 3,
+		    LUASQL_PREFIX"column names must be strings");
+      if (lua_istable(L, data))
+	{
+	  lua_rawget(L, data);
+	  luaL_argcheck(L, lua_istable(L, -1), 3,
+			LUASQL_PREFIX"provider must have an array for each column");
+	}
+      lua_pop(L, 1);
+    }
+  luaL_argcheck(L, lua_isnil(L, index) || lua_type(L, index) == LUA_TSTRING, 3,
+		LUASQL_PREFIX"index must be a column name");
+
+  mod = (module_data *)malloc(sizeof(module_data));
+  if (mod == NULL)
+    return luasql_faildirect(L, "could not allocate the module data");
+  mod->L = conn_functhread(L, conn);
+  mod->conn = conn;
+  mod->ncols = ncols;
+  mod->columns = NULL;
+  mod->rows = LUA_NOREF;
+  mod->index_col = -1;
+  mod->schema = sqlite3_mprintf("CREATE TABLE x(");
+  if (lua_istable(L, data))
+    {
+      mod->columns = (int *)malloc(ncols * sizeof(int));
+      if (mod->columns == NULL)
+	{
+	  sqlite3_free(mod->schema);
+	  free(mod);
+	  return luasql_faildirect(L, "could not allocate the module data");
+	}
+    }
+  for (i = 1; i <= ncols; i++)
+    {
+      const char *column;
+      lua_rawgeti(L, columns, i);
+      column = lua_tostring(L, -1);
+      mod->schema = sqlite3_mprintf("%z%s\"%w\"", mod->schema,
+				    i > 1 ? ", " : "", column);
+      if (lua_type(L, index) == LUA_TSTRING
+	  && strcmp(column, lua_tostring(L, index)) == 0)
+	mod->index_col = i - 1;
+      if (mod->columns != NULL)
+	{
+	  lua_rawget(L, data);
+	  mod->columns[i-1] = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+      else
+	lua_pop(L, 1);
+    }
+  mod->schema = sqlite3_mprintf("%z)", mod->schema);
+  if (mod->columns == NULL)
+    {
+      lua_pushvalue(L, rows);
+      mod->rows = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  lua_pushvalue(L, 3);
+  mod->provider = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  if (mod->schema == NULL)
+    {
+      module_destroy(mod);
+      return luasql_faildirect(L, "could not allocate the module data");
+    }
+  if (lua_type(L, index) == LUA_TSTRING && mod->index_col < 0)
+    {
+      module_destroy(mod);
+      return luasql_faildirect(L, "index is not a column");
+    }
+  /* on failure, module_destroy has already been called */
+  if (sqlite3_create_module_v2(conn->sql_conn, name, &lua_module, mod,
+			       module_destroy) != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+#endif
+
+
+/*
+** Progress handler: interrupt the running call when one of its budgets
+** is exceeded.
+*/
+static int budget_handler(void *p)
+{
+  conn_data *conn = (conn_data *)p;
+
+#ifdef LUASQL_SQLITE3_ASYNC
+  if (conn->async != NULL && async_cancelled(conn->async))
+    return 1;
+#endif
+  if (!conn->budget_running)
+    return 0;
+  conn->budget_used += conn->budget_period;
+  if (conn->budget_steps > 0 && conn->budget_used > conn->budget_steps)
+    conn->budget_exceeded = "step budget exceeded";
+  else if (conn->budget_time > 0
+	   && budget_clock() - conn->budget_start > conn->budget_time)
+    conn->budget_exceeded = "time budget exceeded";
+  return conn->budget_exceeded != NULL;
+}
+
+
+/*
+** Limit the wall time (in seconds) and the number of VM steps each call
+** running statements of the connection may take. A limit of zero or
+** nil means no limit.
+*/
+static int conn_setbudget(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  double seconds = luaL_optnumber(L, 2, 0);
+  double steps = luaL_optnumber(L, 3, 0);
+
+  luaL_argcheck(L, seconds >= 0, 2, LUASQL_PREFIX"invalid time budget");
+  luaL_argcheck(L, steps >= 0, 3, LUASQL_PREFIX"invalid step budget");
+  conn->budget_time = seconds;
+  conn->budget_steps = steps;
+  conn->budget_exceeded = NULL;
+  if (seconds > 0 || steps > 0)
+    {
+      /* check the budgets often enough to honour a small step budget */
+      conn->budget_period = BUDGET_PERIOD;
+      if (steps > 0 && steps < BUDGET_PERIOD)
+        conn->budget_period = (int)steps;
+      sqlite3_progress_handler(conn->sql_conn, conn->budget_period,
+			       budget_handler, conn);
+    }
+  else
+    sqlite3_progress_handler(conn->sql_conn, 0, NULL, NULL);
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Interrupt the statements running on the connection.
+** Useful from SQL functions or profile handlers; the interrupted call
+** fails with an "interrupted" error.
+*/
+static int conn_interrupt(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  sqlite3_interrupt(conn->sql_conn);
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+#if SQLITE_VERSION_NUMBER >= 3014000
+/*
+** Push a table describing a profiled statement.
+*/
+static void push_profile(lua_State *L, const char *sql, sqlite3_int64 time,
+			 const int *counters)
+{
+  int i;
+  lua_newtable(L);
+  lua_pushstring(L, sql);
+  lua_setfield(L, -2, "sql");
+  lua_pushnumber(L, (lua_Number)time / 1e9);
+  lua_setfield(L, -2, "time");
+  for (i = 0; i < PROFILE_COUNTERS; i++)
+    {
+      lua_pushnumber(L, counters[i]);
+      lua_setfield(L, -2, profile_counters[i].name);
+    }
+}
+
+
+/*
+** Trace callback: record a statement which has just finished, either
+** in the ring buffer or by calling the Lua handler. The counters of the
+** statement are reset, so each record covers one execution.
+*/
+static int profile_callback(unsigned type, void *ctx, void *p, void *x)
+{
+  conn_data *conn = (conn_data *)ctx;
+  sqlite3_stmt *vm = (sqlite3_stmt *)p;
+  sqlite3_int64 time = *(sqlite3_int64 *)x;
+  int counters[PROFILE_COUNTERS];
+  char *sql = sqlite3_expanded_sql(vm);
+  int i;
+
+  (void)type;
+  for (i = 0; i < PROFILE_COUNTERS; i++)
+    counters[i] = sqlite3_stmt_status(vm, profile_counters[i].op, 1);
+
+  if (conn->profile != NULL)
+    {
+      profile_entry *entry = &conn->profile[conn->profile_next];
+      sqlite3_free(entry->sql);
+      entry->sql = sql;
+      entry->time = time;
+      memcpy(entry->counters, counters, sizeof(counters));
+      conn->profile_next = (conn->profile_next + 1) % conn->profile_size;
+      if (conn->profile_used < conn->profile_size)
+	conn->profile_used++;
+      return 0;
+    }
+
+  /* errors of the handler cannot be reported inside SQLite */
+  if (lua_checkstack(conn->func_L, 3))
+    {
+      lua_State *T = conn->func_L;
+      lua_rawgeti(T, LUA_REGISTRYINDEX, conn->profile_fn);
+      push_profile(T, sql ? sql : sqlite3_sql(vm), time, counters);
+      if (lua_pcall(T, 1, 0, 0) != 0)
+	lua_pop(T, 1);
+    }
+  sqlite3_free(sql);
+  return 0;
+}
+
+
+/*
+** Set up profiling of the statements run by the connection.
+** With a function, it is called with a record of each statement as
+** soon as it finishes; it must not use the connection.
+** With a number, the last records are kept in a ring buffer of that size,
+** which is read by conn:getprofile.
+** With nil, profiling is stopped.
+*/
+static int conn_setprofile(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+
+  conn_freeprofile(L, conn);
+  if (lua_isfunction(L, 2))
+    {
+      conn_functhread(L, conn);
+      lua_pushvalue(L, 2);
+      conn->profile_fn = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+  else if (!lua_isnoneornil(L, 2))
+    {
+      int size = (int)luaL_checknumber(L, 2);
+      luaL_argcheck(L, size > 0, 2, LUASQL_PREFIX"buffer size must be positive");
+      conn->profile = (profile_entry *)calloc(size, sizeof(profile_entry));
+      if (conn->profile == NULL)
+	return luasql_faildirect(L, "could not allocate the profile buffer");
+      conn->profile_size = size;
+    }
+  else
+    {
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+
+  if (sqlite3_trace_v2(conn->sql_conn, SQLITE_TRACE_PROFILE, profile_callback,
+		       conn) != SQLITE_OK)
+    {
+      conn_freeprofile(L, conn);
+      return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+    }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return the records kept in the profile ring buffer, oldest first,
+** and empty it.
+*/
+static int conn_getprofile(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int i, first;
+
+  lua_newtable(L);
+  if (conn->profile == NULL)
+    return 1;
+  first = (conn->profile_next - conn->profile_used + conn->profile_size)
+    % conn->profile_size;
+  for (i = 0; i < conn->profile_used; i++)
+    {
+      profile_entry *entry = &conn->profile[(first + i) % conn->profile_size];
+      push_profile(L, entry->sql ? entry->sql : "", entry->time, entry->counters);
+      lua_rawseti(L, -2, i + 1);
+      sqlite3_free(entry->sql);
+      entry->sql = NULL;
+    }
+  conn->profile_used = 0;
+  return 1;
+}
+#endif
+
+
+#ifdef LUASQL_SQLITE3_ASYNC
+/*
+** Check for valid asynchronous query.
+*/
+static async_data *getasync(lua_State *L) {
+  async_data *job = (async_data *)luaL_checkudata (L, 1, LUASQL_ASYNC_SQLITE);
+  luaL_argcheck(L, job != NULL, 1, LUASQL_PREFIX"asynchronous query expected");
+  luaL_argcheck(L, !job->closed, 1, LUASQL_PREFIX"asynchronous query is closed");
+  return job;
+}
+
+
+/*
+** Execute an SQL statement on a worker thread.
+** The statement is compiled and bound here; the worker runs it to
+** completion, copying the rows, while the connection cannot be used.
+** Return an asynchronous query object.
+*/
+static int conn_executeasync(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  const char *statement = luaL_checkstring(L, 2);
+  async_data *job;
+  sqlite3_stmt *vm;
+  int res;
+
+  if (conn->func_L != NULL)
+    return luasql_faildirect(L, "asynchronous queries cannot run Lua functions");
+
+  res = conn_prepare_vm(conn, statement, &vm);
+  if (res != SQLITE_OK)
+    return luasql_faildirect(L, sqlite3_errmsg(conn->sql_conn));
+  if (conn_bind_vm(L, conn, vm, 1) != 0)
+    return 2;
+
+  job = (async_data *)LUASQL_NEWUD(L, sizeof(async_data));
+  luasql_setmeta(L, LUASQL_ASYNC_SQLITE);
+
+  /* fill in structure */
+  job->closed = 1;
+  job->conn = LUA_NOREF;
+  job->conn_data = conn;
+  job->vm = vm;
+  job->joined = 0;
+  job->done = 0;
+  job->cancel = 0;
+  job->res = SQLITE_OK;
+  job->errmsg = NULL;
+  job->numcols = sqlite3_column_count(vm);
+  job->changes = 0;
+  job->values = NULL;
+  job->rows = 0;
+  job->capacity = 0;
+
+  if (pipe(job->fds) != 0)
+    {
+      conn_release_vm(conn, vm);
+      return luasql_faildirect(L, "could not create the pipe");
+    }
+  /* the descriptors must not leak into programs run by other threads */
+  (void) fcntl(job->fds[0], F_SETFD, FD_CLOEXEC);
+  (void) fcntl(job->fds[1], F_SETFD, FD_CLOEXEC);
+  pthread_mutex_init(&job->mutex, NULL);
+  conn_startbudget(conn);
+  /* the progress handler also stops a cancelled query */
+  if (conn->budget_time == 0 && conn->budget_steps == 0)
+    sqlite3_progress_handler(conn->sql_conn, BUDGET_PERIOD, budget_handler,
+                             conn);
+  conn->async = job;
+  if (pthread_create(&job->thread, NULL, async_worker, job) != 0)
+    {
+      conn->async = NULL;
+      if (conn->budget_time == 0 && conn->budget_steps == 0)
+        sqlite3_progress_handler(conn->sql_conn, 0, NULL, NULL);
+      pthread_mutex_destroy(&job->mutex);
+      close(job->fds[0]);
+      close(job->fds[1]);
+      conn_release_vm(conn, vm);
+      return luasql_faildirect(L, "could not create the worker thread");
+    }
+
+  job->closed = 0;
+  lua_pushvalue(L, 1);
+  job->conn = luaL_ref(L, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+/*
+** Return the file descriptor which becomes readable when the query is
+** done, to be polled by event loops.
+*/
+static int async_getfd(lua_State *L)
+{
+  async_data *job = getasync(L);
+  lua_pushnumber(L, job->fds[0]);
+  return 1;
+}
+
+
+/*
+** Check whether the query is done, without blocking.
+*/
+static int async_ready(lua_State *L)
+{
+  async_data *job = getasync(L);
+  lua_pushboolean(L, async_done(job));
+  return 1;
+}
+
+
+/*
+** Wait for the query to be done and close the object.
+** Return an array of rows (arrays of values) and the list of column
+** names if the statement is a query, otherwise the number of tuples
+** affected by the statement.
+*/
+static int async_result(lua_State *L)
+{
+  async_data *job = getasync(L);
+  int ret;
+
+  async_join(job);
+  if (job->res != SQLITE_DONE)
+    ret = luasql_faildirect(L, job->errmsg ? job->errmsg : "not enough memory");
+  else if (job->numcols > 0)
+    {
+      int r, i;
+      sqlite3_value **value = job->values;
+      lua_createtable(L, job->rows, 0);
+      for (r = 1; r <= job->rows; r++)
+        {
+          lua_createtable(L, job->numcols, 0);
+          for (i = 1; i <= job->numcols; i++)
+            {
+              push_value(L, *value++);
+              lua_rawseti(L, -2, i);
+            }
+          lua_rawseti(L, -2, r);
+        }
+      lua_createtable(L, job->numcols, 0);
+      for (i = 0; i < job->numcols; i++)
+        {
+          lua_pushstring(L, sqlite3_column_name(job->vm, i));
+          lua_rawseti(L, -2, i+1);
+        }
+      ret = 2;
+    }
+  else
     {
-      return create_cursor(L, 1, conn, vm, numcols);
+      lua_pushnumber(L, job->changes);
+      ret = 1;
     }
+  async_finish(L, job);
+  return ret;
+}
 
-  if (res == SQLITE_DONE) /* and numcols==0, INSERT,UPDATE,DELETE statement */
+
+/*
+** Interrupt the query, if still running, and close the object.
+*/
+static int async_close(lua_State *L)
+{
+  async_data *job = (async_data *)luaL_checkudata(L, 1, LUASQL_ASYNC_SQLITE);
+  luaL_argcheck(L, job != NULL, 1, LUASQL_PREFIX"asynchronous query expected");
+  if (job->closed)
     {
-      sqlite3_finalize(vm);
-      /* return number of columns changed */
-      lua_pushnumber(L, sqlite3_changes(conn->sql_conn));
-      return 1;
+      lua_pushboolean(L, 0);
+      lua_pushstring(L, "asynchronous query is already closed");
+      return 2;
     }
+  async_finish(L, job);
+  lua_pushboolean(L, 1);
+  return 1;
+}
 
-  /* error */
-  errmsg = sqlite3_errmsg(conn->sql_conn);
-  sqlite3_finalize(vm);
-  return luasql_faildirect(L, errmsg);
+
+/*
+** Asynchronous query collector function
+*/
+static int async_gc(lua_State *L)
+{
+  async_data *job = (async_data *)luaL_checkudata(L, 1, LUASQL_ASYNC_SQLITE);
+  if (job != NULL && !(job->closed))
+    async_finish(L, job);
+  return 0;
 }
+#endif
 
 
 /*
@@ -562,6 +3876,7 @@ static int conn_commit(lua_State *L)
 
   if (conn->auto_commit == 0) sql = "COMMIT;BEGIN";
 
+  conn_stopbudget(conn);
   res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
 
   if (res != SQLITE_OK)
@@ -590,6 +3905,7 @@ static int conn_rollback(lua_State *L)
 
   if (conn->auto_commit == 0) sql = "ROLLBACK;BEGIN";
 
+  conn_stopbudget(conn);
   res = sqlite3_exec(conn->sql_conn, sql, NULL, NULL, &errmsg);
   if (res != SQLITE_OK)
     {
@@ -612,6 +3928,193 @@ static int conn_getlastautoid(lua_State *L)
 }
 
 
+/*
+** Set the maximum number of vms kept by the statement cache.
+** Zero (the default) disables the cache.
+*/
+static int conn_setstmtcache(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int size = (int)luaL_checknumber(L, 2);
+  cache_entry *cache;
+
+  luaL_argcheck(L, size >= 0, 2, LUASQL_PREFIX"invalid cache size");
+  cache_trim(conn, size, 1);
+  if (size == 0)
+    {
+      free(conn->stmt_cache);
+      cache = NULL;
+    }
+  else
+    {
+      cache = (cache_entry *)realloc(conn->stmt_cache,
+                                     size * sizeof(cache_entry));
+      if (cache == NULL)
+        return luasql_faildirect(L, "could not allocate the statement cache");
+    }
+  conn->stmt_cache = cache;
+  conn->stmt_cache_size = size;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** Return a table with the statement cache counters.
+*/
+static int conn_getstmtcachestats(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  lua_newtable(L);
+  lua_pushnumber(L, conn->stmt_cache_hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, conn->stmt_cache_misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, conn->stmt_cache_evictions);
+  lua_setfield(L, -2, "evictions");
+  lua_pushnumber(L, conn->stmt_cache_used);
+  lua_setfield(L, -2, "used");
+  lua_pushnumber(L, conn->stmt_cache_size);
+  lua_setfield(L, -2, "size");
+  return 1;
+}
+
+
+/* What a status counter reports */
+#define STATUS_CURRENT   1
+#define STATUS_HIGHWATER 2
+
+
+/*
+** Counters of sqlite3_db_status reported by conn:stats.
+*/
+static const struct {
+  const char *name;
+  int        op;
+  int        report;
+} db_counters[] = {
+  {"lookaside_used", SQLITE_DBSTATUS_LOOKASIDE_USED, STATUS_CURRENT | STATUS_HIGHWATER},
+#ifdef SQLITE_DBSTATUS_LOOKASIDE_HIT
+  {"lookaside_hit", SQLITE_DBSTATUS_LOOKASIDE_HIT, STATUS_HIGHWATER},
+  {"lookaside_miss_size", SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE, STATUS_HIGHWATER},
+  {"lookaside_miss_full", SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL, STATUS_HIGHWATER},
+#endif
+  {"cache_used", SQLITE_DBSTATUS_CACHE_USED, STATUS_CURRENT},
+#ifdef SQLITE_DBSTATUS_CACHE_USED_SHARED
+  {"cache_used_shared", SQLITE_DBSTATUS_CACHE_USED_SHARED, STATUS_CURRENT},
+#endif
+#ifdef SQLITE_DBSTATUS_CACHE_HIT
+  {"cache_hit", SQLITE_DBSTATUS_CACHE_HIT, STATUS_CURRENT},
+  {"cache_miss", SQLITE_DBSTATUS_CACHE_MISS, STATUS_CURRENT},
+#endif
+#ifdef SQLITE_DBSTATUS_CACHE_WRITE
+  {"cache_write", SQLITE_DBSTATUS_CACHE_WRITE, STATUS_CURRENT},
+#endif
+#ifdef SQLITE_DBSTATUS_CACHE_SPILL
+  {"cache_spill", SQLITE_DBSTATUS_CACHE_SPILL, STATUS_CURRENT},
+#endif
+  {"schema_used", SQLITE_DBSTATUS_SCHEMA_USED, STATUS_CURRENT},
+  {"stmt_used", SQLITE_DBSTATUS_STMT_USED, STATUS_CURRENT},
+#ifdef SQLITE_DBSTATUS_DEFERRED_FKS
+  {"deferred_fks", SQLITE_DBSTATUS_DEFERRED_FKS, STATUS_CURRENT},
+#endif
+  {NULL, 0, 0},
+};
+
+
+/*
+** Counters of sqlite3_status reported by luasql.memstats.
+*/
+static const struct {
+  const char *name;
+  int        op;
+  int        report;
+} mem_counters[] = {
+  {"memory_used", SQLITE_STATUS_MEMORY_USED, STATUS_CURRENT | STATUS_HIGHWATER},
+  {"malloc_size", SQLITE_STATUS_MALLOC_SIZE, STATUS_HIGHWATER},
+  {"malloc_count", SQLITE_STATUS_MALLOC_COUNT, STATUS_CURRENT | STATUS_HIGHWATER},
+  {"pagecache_used", SQLITE_STATUS_PAGECACHE_USED, STATUS_CURRENT | STATUS_HIGHWATER},
+  {"pagecache_overflow", SQLITE_STATUS_PAGECACHE_OVERFLOW, STATUS_CURRENT | STATUS_HIGHWATER},
+  {"pagecache_size", SQLITE_STATUS_PAGECACHE_SIZE, STATUS_HIGHWATER},
+  {"parser_stack", SQLITE_STATUS_PARSER_STACK, STATUS_HIGHWATER},
+  {NULL, 0, 0},
+};
+
+
+/*
+** Set the fields of the table on top of the stack for a counter: 'name'
+** for its current value and 'name_highwater' for its high-water mark.
+*/
+static void push_status(lua_State *L, const char *name, int report,
+			double current, double highwater)
+{
+  if (report & STATUS_CURRENT)
+    {
+      lua_pushnumber(L, current);
+      lua_setfield(L, -2, name);
+    }
+  if (report & STATUS_HIGHWATER)
+    {
+      lua_pushfstring(L, "%s%s", name,
+		      (report & STATUS_CURRENT) ? "_highwater" : "");
+      lua_pushnumber(L, highwater);
+      lua_rawset(L, -3);
+    }
+}
+
+
+/*
+** Return a table with the memory and cache statistics of the connection.
+** If 'reset' is true, the high-water marks and the cache counters are
+** reset afterwards.
+*/
+static int conn_stats(lua_State *L)
+{
+  conn_data *conn = getconnection(L);
+  int reset = lua_toboolean(L, 2);
+  int i;
+
+  lua_newtable(L);
+  for (i = 0; db_counters[i].name != NULL; i++)
+    {
+      int current = 0, highwater = 0;
+      if (sqlite3_db_status(conn->sql_conn, db_counters[i].op, &current,
+			    &highwater, reset) == SQLITE_OK)
+	push_status(L, db_counters[i].name, db_counters[i].report,
+		    current, highwater);
+    }
+  return 1;
+}
+
+
+/*
+** Return a table with the memory statistics of SQLite in the process.
+** If 'reset' is true, the high-water marks are reset afterwards.
+*/
+static int mem_stats(lua_State *L)
+{
+  int reset = lua_toboolean(L, 1);
+  int i;
+
+  lua_newtable(L);
+  for (i = 0; mem_counters[i].name != NULL; i++)
+    {
+#if SQLITE_VERSION_NUMBER >= 3010000
+      sqlite3_int64 current = 0, highwater = 0;
+      if (sqlite3_status64(mem_counters[i].op, &current, &highwater,
+			   reset) == SQLITE_OK)
+#else
+      int current = 0, highwater = 0;
+      if (sqlite3_status(mem_counters[i].op, &current, &highwater,
+			 reset) == SQLITE_OK)
+#endif
+	push_status(L, mem_counters[i].name, mem_counters[i].report,
+		    (double)current, (double)highwater);
+    }
+  return 1;
+}
+
+
 /*
 ** Set "auto commit" property of the connection.
 ** If 'true', then rollback current transaction.
@@ -620,6 +4123,7 @@ static int conn_getlastautoid(lua_State *L)
 static int conn_setautocommit(lua_State *L)
 {
   conn_data *conn = getconnection(L);
+  conn_stopbudget(conn);
   if (lua_toboolean(L, 2))
     {
       conn->auto_commit = 1;
@@ -660,27 +4164,303 @@ static int create_connection(lua_State *L, int env, sqlite3 *sql_conn)
   conn->auto_commit = 1;
   conn->sql_conn = sql_conn;
   conn->cur_counter = 0;
+  conn->stmt_counter = 0;
+  conn->blob_counter = 0;
+  conn->schema_lock = 0;
+  conn->backup_counter = 0;
+  conn->func_L = NULL;
+  conn->func_thread = LUA_NOREF;
+  conn->func_users = 0;
+  conn->profile_fn = LUA_NOREF;
+  conn->profile = NULL;
+  conn->profile_size = 0;
+  conn->profile_next = 0;
+  conn->profile_used = 0;
+  conn->budget_time = 0;
+  conn->budget_steps = 0;
+  conn->budget_start = 0;
+  conn->budget_used = 0;
+  conn->budget_exceeded = NULL;
+  conn->budget_running = 0;
+  conn->budget_period = 0;
+  conn->async = NULL;
+  conn->deferred = NULL;
+  conn->stmt_cache = NULL;
+  conn->stmt_cache_size = 0;
+  conn->stmt_cache_used = 0;
+  conn->stmt_cache_hits = 0;
+  conn->stmt_cache_misses = 0;
+  conn->stmt_cache_evictions = 0;
   lua_pushvalue (L, env);
   conn->env = luaL_ref (L, LUA_REGISTRYINDEX);
   return 1;
 }
 
 
+#if SQLITE_VERSION_NUMBER > 3006013
+/*
+** Open flags which may be set in the options table of env:connect.
+*/
+static const struct {
+  const char *name;
+  int        flag;
+} connect_flags[] = {
+  {"nomutex", SQLITE_OPEN_NOMUTEX},
+  {"fullmutex", SQLITE_OPEN_FULLMUTEX},
+  {"sharedcache", SQLITE_OPEN_SHAREDCACHE},
+  {"privatecache", SQLITE_OPEN_PRIVATECACHE},
+  {"uri", SQLITE_OPEN_URI},
+  {NULL, 0},
+};
+#endif
+
+
+/*
+** Pragmas which may be set in the options table of env:connect, in the
+** order they are applied (page_size must precede journal_mode).
+*/
+static const char *const connect_pragmas[] = {
+  "page_size", "journal_mode", "synchronous", "cache_size", "mmap_size",
+  "temp_store", NULL
+};
+
+
+/*
+** Apply the pragmas found in the options table at stack index 't'.
+** Return 0 in case of success, otherwise push nil and an error message
+** and return 2.
+*/
+static int apply_pragmas(lua_State *L, sqlite3 *conn, int t)
+{
+  int i;
+
+  for (i = 0; connect_pragmas[i] != NULL; i++)
+    {
+      char *sql;
+      char *errmsg;
+      int res;
+
+      lua_getfield(L, t, connect_pragmas[i]);
+      if (lua_isnil(L, -1))
+        {
+          lua_pop(L, 1);
+          continue;
+        }
+      switch (lua_type(L, -1))
+        {
+        case LUA_TNUMBER:
+          sql = sqlite3_mprintf("PRAGMA %s=%lld", connect_pragmas[i],
+                                (sqlite3_int64)lua_tonumber(L, -1));
+          break;
+        case LUA_TBOOLEAN:
+          sql = sqlite3_mprintf("PRAGMA %s=%d", connect_pragmas[i],
+                                lua_toboolean(L, -1));
+          break;
+        case LUA_TSTRING:
+          sql = sqlite3_mprintf("PRAGMA %s=%Q", connect_pragmas[i],
+                                lua_tostring(L, -1));
+          break;
+        default:
+          lua_pop(L, 1);
+          lua_pushnil(L);
+          lua_pushfstring(L, LUASQL_PREFIX"%s: invalid value", connect_pragmas[i]);
+          return 2;
+        }
+      lua_pop(L, 1);
+
+      res = sqlite3_exec(conn, sql, NULL, NULL, &errmsg);
+      sqlite3_free(sql);
+      if (res != SQLITE_OK)
+        {
+          lua_pushnil(L);
+          lua_pushfstring(L, LUASQL_PREFIX"%s: %s", connect_pragmas[i], errmsg);
+          sqlite3_free(errmsg);
+          return 2;
+        }
+    }
+  return 0;
+}
+
+
+#if SQLITE_VERSION_NUMBER > 3006013
+/*
+** Registry of the shared caches, shared by all Lua states of the process.
+*/
+static shared_cache *shared_caches = NULL;
+
+
+static sqlite3_mutex *shared_mutex(void)
+{
+  return sqlite3_mutex_alloc(SQLITE_MUTEX_STATIC_APP1);
+}
+
+
+/*
+** Make the environment use the shared cache of the given database,
+** opening its anchor connection with 'mode' if no environment of any
+** Lua state uses it yet.
+** Caches are told apart by the exact source name, which is not
+** canonicalized.
+** Return NULL in case of success, otherwise an error message.
+*/
+static const char *shared_acquire(env_data *env, const char *path, int mode)
+{
+  sqlite3_mutex *mutex = shared_mutex();
+  shared_cache *cache;
+  shared_use *use;
+  const char *errmsg = NULL;
+
+  for (use = env->shared; use != NULL; use = use->next)
+    if (strcmp(use->cache->path, path) == 0)
+      return NULL;
+
+  use = (shared_use *)malloc(sizeof(shared_use));
+  if (use == NULL)
+    return "could not allocate the shared cache";
+
+  sqlite3_mutex_enter(mutex);
+  for (cache = shared_caches; cache != NULL; cache = cache->next)
+    if (strcmp(cache->path, path) == 0)
+      break;
+  if (cache == NULL)
+    {
+      cache = (shared_cache *)malloc(sizeof(shared_cache) + strlen(path) + 1);
+      if (cache == NULL)
+        errmsg = "could not allocate the shared cache";
+      else if (sqlite3_open_v2(path, &cache->anchor, mode, NULL) != SQLITE_OK)
+        {
+          errmsg = "could not open the shared cache";
+          sqlite3_close(cache->anchor);
+          free(cache);
+        }
+      if (errmsg != NULL)
+        {
+          sqlite3_mutex_leave(mutex);
+          free(use);
+          return errmsg;
+        }
+      cache->path = strcpy((char *)(cache + 1), path);
+      cache->refs = 0;
+      cache->next = shared_caches;
+      shared_caches = cache;
+    }
+  cache->refs++;
+  sqlite3_mutex_leave(mutex);
+
+  use->cache = cache;
+  use->next = env->shared;
+  env->shared = use;
+  return NULL;
+}
+
+
+/*
+** Release the shared cache most recently used by the environment,
+** closing its anchor connection if no environment uses it anymore.
+** Must be called with the registry mutex held.
+*/
+static void shared_drop(env_data *env)
+{
+  shared_use *use = env->shared;
+  shared_cache *cache = use->cache;
+
+  env->shared = use->next;
+  free(use);
+  if (--cache->refs == 0)
+    {
+      shared_cache **p = &shared_caches;
+      while (*p != cache)
+        p = &(*p)->next;
+      *p = cache->next;
+      sqlite3_close(cache->anchor);
+      free(cache);
+    }
+}
+
+
+/*
+** Release the shared caches acquired by the environment since its list
+** of caches was 'used' (all of them if 'used' is NULL).
+*/
+static void shared_release_since(env_data *env, shared_use *used)
+{
+  sqlite3_mutex *mutex = shared_mutex();
+
+  sqlite3_mutex_enter(mutex);
+  while (env->shared != NULL && env->shared != used)
+    shared_drop(env);
+  sqlite3_mutex_leave(mutex);
+}
+
+
+/*
+** Release the shared caches used by the environment, closing the
+** anchor connections no environment uses anymore.
+*/
+static void shared_release(env_data *env)
+{
+  shared_release_since(env, NULL);
+}
+
+
+/*
+** Return a table with the number of environments, in all Lua states,
+** using the shared cache of each database.
+*/
+static int shared_list(lua_State *L)
+{
+  sqlite3_mutex *mutex = shared_mutex();
+  shared_cache *cache;
+
+  lua_newtable(L);
+  sqlite3_mutex_enter(mutex);
+  for (cache = shared_caches; cache != NULL; cache = cache->next)
+    {
+      lua_pushnumber(L, cache->refs);
+      lua_setfield(L, -2, cache->path);
+    }
+  sqlite3_mutex_leave(mutex);
+  return 1;
+}
+#else
+static void shared_release_since(env_data *env, shared_use *used)
+{
+  (void)env;
+  (void)used;
+}
+
+
+static void shared_release(env_data *env)
+{
+  (void)env;
+}
+#endif
+
+
 /*
 ** Connects to a data source.
+** The parameters after the source name are either the lock timeout and
+** the read only flag or a table of options.
 */
 static int env_connect(lua_State *L)
 {
+  env_data *env = getenvironment(L);
   const char *sourcename;
   sqlite3 *conn;
   const char *errmsg;
   int res;
   bool readOnlyMode = false;
   int mode;
+  int options = 0;           /* stack index of the options table */
+  int shared = 0;
+  shared_use *used = env->shared;  /* shared caches used before */
 
-  getenvironment(L);  /* validate environment */
-
-  if (lua_isboolean(L, 4)) {
+  if (lua_istable(L, 3)) {
+    options = 3;
+    lua_getfield(L, options, "readonly");
+    readOnlyMode = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  } else if (lua_isboolean(L, 4)) {
     if (lua_toboolean(L, 4)) {
       readOnlyMode = true;
     }
@@ -688,7 +4468,7 @@ static int env_connect(lua_State *L)
 
   sourcename = luaL_checkstring(L, 2);
 #if SQLITE_VERSION_NUMBER > 3006013
-  if (strstr(sourcename, ":memory:")) /* TODO: rework this and get/add param 'flag' for sqlite3_open_v2 - see TODO below */
+  if (strstr(sourcename, ":memory:"))
   {
     if (readOnlyMode) {
       mode = SQLITE_OPEN_READONLY | SQLITE_OPEN_MEMORY;
@@ -704,6 +4484,31 @@ static int env_connect(lua_State *L)
       mode = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
     }
   }
+  if (options != 0)
+  {
+    int i;
+    for (i = 0; connect_flags[i].name != NULL; i++)
+    {
+      lua_getfield(L, options, connect_flags[i].name);
+      if (lua_toboolean(L, -1))
+        mode |= connect_flags[i].flag;
+      lua_pop(L, 1);
+    }
+    /* raw SQLITE_OPEN_* flags */
+    lua_getfield(L, options, "flags");
+    mode |= (int)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, options, "shared");
+    shared = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  if (shared)
+  {
+    mode |= SQLITE_OPEN_SHAREDCACHE;
+    errmsg = shared_acquire(env, sourcename, mode);
+    if (errmsg != NULL)
+      return luasql_faildirect(L, errmsg);
+  }
   res = sqlite3_open_v2(sourcename, &conn, mode, NULL);
 #else
   res = sqlite3_open(sourcename, &conn);
@@ -713,14 +4518,31 @@ static int env_connect(lua_State *L)
       errmsg = sqlite3_errmsg(conn);
       luasql_faildirect(L, errmsg);
       sqlite3_close(conn);
+      shared_release_since(env, used);
       return 2;
     }
 
-  if (lua_isnumber(L, 3)) {
+  if (options != 0) {
+    lua_getfield(L, options, "timeout");
+    if (lua_isnumber(L, -1))
+      sqlite3_busy_timeout(conn, lua_tonumber(L, -1));
+    lua_pop(L, 1);
+    if (apply_pragmas(L, conn, options) != 0) {
+      sqlite3_close(conn);
+      shared_release_since(env, used);
+      return 2;
+    }
+  } else if (lua_isnumber(L, 3)) {
   	sqlite3_busy_timeout(conn, lua_tonumber(L,3)); /* TODO: remove this */
   }
 
-  return create_connection(L, 1, conn);
+  create_connection(L, 1, conn);
+  if (options != 0) {
+    lua_getfield(L, options, "schemalock");
+    ((conn_data *)lua_touserdata(L, -2))->schema_lock = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  return 1;
 }
 
 
@@ -731,7 +4553,10 @@ static int env_gc (lua_State *L)
 {
   env_data *env = (env_data *)luaL_checkudata(L, 1, LUASQL_ENVIRONMENT_SQLITE);
   if (env != NULL && !(env->closed))
-    env->closed = 1;
+    {
+      env->closed = 1;
+      shared_release(env);
+    }
   return 0;
 }
 
@@ -750,6 +4575,7 @@ static int env_close (lua_State *L)
   }
 
   env->closed = 1;
+  shared_release(env);
 
   lua_pushboolean(L, 1);
   return 1;
@@ -767,6 +4593,42 @@ static int opts_settimeout  (lua_State *L)
 }
 */
 
+/*
+** Blob value collector function
+*/
+static int blobvalue_gc(lua_State *L)
+{
+  blobvalue_data *blob = (blobvalue_data *)luaL_checkudata(L, 1, LUASQL_BLOBVALUE_SQLITE);
+  if (blob != NULL && !(blob->closed))
+    {
+      blob->closed = 1;
+      luaL_unref(L, LUA_REGISTRYINDEX, blob->ref);
+    }
+  return 0;
+}
+
+
+/*
+** Wrap a string so that it is bound as a BLOB instead of TEXT.
+** The string is referenced, not copied.
+*/
+static int create_blobvalue (lua_State *L)
+{
+  size_t len;
+  const char *data = luaL_checklstring(L, 1, &len);
+  blobvalue_data *blob = (blobvalue_data *)LUASQL_NEWUD(L, sizeof(blobvalue_data));
+  luasql_setmeta(L, LUASQL_BLOBVALUE_SQLITE);
+
+  /* fill in structure */
+  blob->closed = 0;
+  lua_pushvalue(L, 1);
+  blob->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  blob->data = data;
+  blob->len = len;
+  return 1;
+}
+
+
 /*
 ** Create metatables for each class of object.
 */
@@ -784,12 +4646,37 @@ static void create_metatables (lua_State *L)
     {"__close", conn_gc},
     {"close", conn_close},
     {"escape", conn_escape},
-//    {"prepare", conn_prepare},
+    {"prepare", conn_prepare},
     {"execute", conn_execute},
+    {"executemany", conn_executemany},
+    {"exec_script", conn_exec_script},
     {"commit", conn_commit},
     {"rollback", conn_rollback},
     {"setautocommit", conn_setautocommit},
     {"getlastautoid", conn_getlastautoid},
+    {"setstmtcache", conn_setstmtcache},
+    {"getstmtcachestats", conn_getstmtcachestats},
+    {"stats", conn_stats},
+    {"openblob", conn_openblob},
+    {"backup", conn_backup},
+    {"createfunction", conn_createfunction},
+    {"createaggregate", conn_createaggregate},
+#if SQLITE_VERSION_NUMBER >= 3009000
+    {"createmodule", conn_createmodule},
+#endif
+    {"setbudget", conn_setbudget},
+    {"interrupt", conn_interrupt},
+#ifdef LUASQL_SQLITE3_ASYNC
+    {"executeasync", conn_executeasync},
+#endif
+#if SQLITE_VERSION_NUMBER >= 3014000
+    {"setprofile", conn_setprofile},
+    {"getprofile", conn_getprofile},
+#endif
+#if SQLITE_VERSION_NUMBER >= 3036000
+    {"serialize", conn_serialize},
+    {"deserialize", conn_deserialize},
+#endif
     {NULL, NULL},
   };
   struct luaL_Reg cursor_methods[] = {
@@ -799,12 +4686,65 @@ static void create_metatables (lua_State *L)
     {"getcolnames", cur_getcolnames},
     {"getcoltypes", cur_getcoltypes},
     {"fetch", cur_fetch},
+    {"fetchmany", cur_fetchmany},
+    {"fetchall", cur_fetchall},
+    {"fetchcolumns", cur_fetchcolumns},
+    {"rows", cur_rows},
+    {NULL, NULL},
+  };
+  struct luaL_Reg statement_methods[] = {
+    {"__gc", stmt_gc},
+    {"__close", stmt_gc},
+    {"close", stmt_close},
+    {"execute", stmt_execute},
+    {"reset", stmt_reset},
+    {"getparamcount", stmt_getparamcount},
+    {NULL, NULL},
+  };
+  struct luaL_Reg blob_methods[] = {
+    {"__gc", blob_gc},
+    {"__close", blob_gc},
+    {"close", blob_close},
+    {"read", blob_read},
+    {"write", blob_write},
+    {"size", blob_size},
+    {"reopen", blob_reopen},
+    {NULL, NULL},
+  };
+  struct luaL_Reg backup_methods[] = {
+    {"__gc", backup_gc},
+    {"__close", backup_gc},
+    {"close", backup_close},
+    {"step", backup_step},
+    {NULL, NULL},
+  };
+#ifdef LUASQL_SQLITE3_ASYNC
+  struct luaL_Reg async_methods[] = {
+    {"__gc", async_gc},
+    {"__close", async_gc},
+    {"close", async_close},
+    {"getfd", async_getfd},
+    {"ready", async_ready},
+    {"result", async_result},
+    {NULL, NULL},
+  };
+#endif
+  struct luaL_Reg blobvalue_methods[] = {
+    {"__gc", blobvalue_gc},
     {NULL, NULL},
   };
   luasql_createmeta(L, LUASQL_ENVIRONMENT_SQLITE, environment_methods);
   luasql_createmeta(L, LUASQL_CONNECTION_SQLITE, connection_methods);
   luasql_createmeta(L, LUASQL_CURSOR_SQLITE, cursor_methods);
-  lua_pop (L, 3);
+  luasql_createmeta(L, LUASQL_STATEMENT_SQLITE, statement_methods);
+  luasql_createmeta(L, LUASQL_BLOB_SQLITE, blob_methods);
+  luasql_createmeta(L, LUASQL_BACKUP_SQLITE, backup_methods);
+  luasql_createmeta(L, LUASQL_BLOBVALUE_SQLITE, blobvalue_methods);
+  lua_pop (L, 7);
+#ifdef LUASQL_SQLITE3_ASYNC
+  luasql_createmeta(L, LUASQL_ASYNC_SQLITE, async_methods);
+  lua_pop (L, 1);
+#endif
 }
 
 /*
@@ -817,6 +4757,7 @@ static int create_environment (lua_State *L)
 
   /* fill in structure */
   env->closed = 0;
+  env->shared = NULL;
   return 1;
 }
 
@@ -829,6 +4770,11 @@ LUASQL_API int luaopen_luasql_sqlite3(lua_State *L)
 {
   struct luaL_Reg driver[] = {
     {"sqlite3", create_environment},
+    {"blob", create_blobvalue},
+    {"memstats", mem_stats},
+#if SQLITE_VERSION_NUMBER > 3006013
+    {"sharedcaches", shared_list},
+#endif
     {NULL, NULL},
   };
   create_metatables (L);
@@ -2,6 +2,9 @@
 -- See Copyright Notice in license.html
 
 TOTAL_ROWS = 200
+-- rows and columns of the wide table scanned by the SQLite3 benchmark
+WIDE_ROWS = 1000000
+WIDE_COLS = 20
 
 ---------------------------------------------------------------------
 -- checks for a value and throw an error if it is invalid.
@@ -60,7 +63,7 @@ local datasource = arg[2] or "luasql-test"
 local username = arg[3] or nil
 local password = arg[4] or nil
 
-require (arg[1])
+local luasql = require ("luasql."..driver)
 assert (luasql, "no luasql table")
 
 local env, err = luasql[driver] ()
@@ -99,12 +102,13 @@ local t1 = os.clock()
 --for i = 1, cur:numrows() do
 	--local f1,f2,f3,f4,f5,f6,f7,f8 = cur:fetch()
 --end
-local f1,f2,f3,f4,f5,f6,f7,f8 = cur:fetch()
-while f1 do
-	f1,f2,f3,f4,f5,f6,f7,f8 = cur:fetch()
+-- fetch exactly the rows, so that the cursor is left open
+for i = 1, TOTAL_ROWS do
+	local f1,f2,f3,f4,f5,f6,f7,f8 = cur:fetch()
+	assert (f1, "missing row")
 end
 print ("default: ", os.clock() - t1)
-assert (cur:close () == 1, "couldn't close cursor object")
+assert (cur:close (), "couldn't close cursor object")
 
 -- using the same table
 local cur, err = conn:execute ("select * from fetch_test")
@@ -115,12 +119,11 @@ local t = {}
 --for i = 1, cur:numrows() do
 	--t = cur:fetch (t)
 --end
-t = cur:fetch(t)
-while t do
-	t = cur:fetch(t)
+for i = 1, TOTAL_ROWS do
+	t = assert (cur:fetch (t), "missing row")
 end
 print ("same table: ", os.clock() - t1)
-assert (cur:close () == 1, "couldn't close cursor object")
+assert (cur:close (), "couldn't close cursor object")
 
 -- using the same table with alphanumeric keys
 local cur, err = conn:execute ("select * from fetch_test")
@@ -131,12 +134,11 @@ local t = {}
 --for i = 1, cur:numrows() do
 	--t = cur:fetch (t,"a")
 --end
-t = cur:fetch (t, "a")
-while t do
-	t = cur:fetch (t, "a")
+for i = 1, TOTAL_ROWS do
+	t = assert (cur:fetch (t, "a"), "missing row")
 end
 print ("alpha keys: ", os.clock() - t1)
-assert (cur:close () == 1, "couldn't close cursor object")
+assert (cur:close (), "couldn't close cursor object")
 
 -- using the same table with numeric and alphanumeric keys
 local cur, err = conn:execute ("select * from fetch_test")
@@ -147,12 +149,11 @@ local t = {}
 --for i = 1, cur:numrows() do
 	--t = cur:fetch (t,"an")
 --end
-t = cur:fetch (t, "an")
-while t do
-	t = cur:fetch (t, "an")
+for i = 1, TOTAL_ROWS do
+	t = assert (cur:fetch (t, "an"), "missing row")
 end
 print ("all keys: ", os.clock() - t1)
-assert (cur:close () == 1, "couldn't close cursor object")
+assert (cur:close (), "couldn't close cursor object")
 
 -- creating a table
 local cur, err = conn:execute ("select * from fetch_test")
@@ -162,10 +163,80 @@ t1 = os.clock()
 --for i = 1, cur:numrows() do
 	--local t = cur:fetch{}
 --end
-while cur:fetch{} do
+for i = 1, TOTAL_ROWS do
+	assert (cur:fetch{}, "missing row")
 end
 print ("new table: ", os.clock() - t1)
-assert (cur:close () == 1, "couldn't close cursor object")
+assert (cur:close (), "couldn't close cursor object")
+
+-- scanning a wide table: the cost per cell is what is measured here,
+-- first with the generic column conversion of SQLite3 cursors and then
+-- with the schema lock, where the first row fixes the accessor of each
+-- column
+if driver == "sqlite3" then
+	conn:execute ("drop table wide_test")
+	local cols, vals = {}, {}
+	for i = 1, WIDE_COLS do
+		local kind = i % 3
+		if kind == 0 then
+			cols[i] = "f"..i.." integer"
+			vals[i] = "x * "..i
+		elseif kind == 1 then
+			cols[i] = "f"..i.." real"
+			vals[i] = "x / "..i..".0"
+		else
+			cols[i] = "f"..i.." text"
+			vals[i] = "'value '||x"
+		end
+	end
+	assert (conn:execute ("create table wide_test ("..table.concat (cols, ", ")..")"))
+	assert (conn:execute (string.format ([[
+		insert into wide_test
+		with recursive s(x) as (select 1 union all select x+1 from s where x < %d)
+		select %s from s]], WIDE_ROWS, table.concat (vals, ", "))))
+	print (string.format ("wide table created; %d rows of %d columns inserted",
+		WIDE_ROWS, WIDE_COLS))
+	assert (conn:close (), "couldn't close connection object")
+
+	for _, lock in ipairs { false, true } do
+		local mode = lock and "locked" or "unlocked"
+		conn = assert (env:connect (datasource, { schemalock = lock }))
+
+		local cur = assert (conn:execute ("select * from wide_test"))
+		t1 = os.clock()
+		while cur:fetch () do
+		end
+		print ("wide, "..mode..", values: ", os.clock() - t1)
+
+		cur = assert (conn:execute ("select * from wide_test"))
+		t1 = os.clock()
+		local t = {}
+		while cur:fetch (t) do
+		end
+		print ("wide, "..mode..", same table: ", os.clock() - t1)
+
+		cur = assert (conn:execute ("select * from wide_test"))
+		t1 = os.clock()
+		while cur:fetch (t, "a") do
+		end
+		print ("wide, "..mode..", alpha keys: ", os.clock() - t1)
+
+		cur = assert (conn:execute ("select * from wide_test"))
+		t1 = os.clock()
+		local n = 0
+		repeat
+			local cols, rows = cur:fetchcolumns (10000)
+			n = n + (rows or 0)
+		until not cols
+		assert2 (WIDE_ROWS, n)
+		print ("wide, "..mode..", columns: ", os.clock() - t1)
+		if lock then
+			conn:execute ("drop table wide_test")
+		else
+			assert (conn:close (), "couldn't close connection object")
+		end
+	end
+end
 
-assert (conn:close () == 1, "couldn't close connection object")
-assert (env:close () == 1, "couldn't close environment object")
+assert (conn:close (), "couldn't close connection object")
+assert (env:close (), "couldn't close environment object")
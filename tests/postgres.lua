@@ -9,3 +9,143 @@ table.insert (CUR_METHODS, "numrows")
 table.insert (EXTENSIONS, numrows)
 table.insert (CONN_METHODS, "escape")
 table.insert (EXTENSIONS, escape)
+
+table.insert (EXTENSIONS, function ()
+	-- type names are cached by the connection after the first cursor
+	local sql = "select 1::int4 as a, 'x'::text as b, 2::int4 as c, 'y'::varchar(5) as d"
+	for i = 1, 2 do
+		local cur = CUR_OK (CONN:execute (sql))
+		local types = cur:getcoltypes ()
+		assert2 ("int4", types[1])
+		assert2 ("text", types[2])
+		assert2 ("int4", types[3])
+		assert2 ("varchar (5)", types[4])
+		cur:close ()
+	end
+	io.write (" coltypes")
+end)
+
+table.insert (CONN_METHODS, "executestream")
+table.insert (EXTENSIONS, function ()
+	local cur = CUR_OK (CONN:executestream ("select g, 'r'||g from generate_series(1, 10) g", 3))
+	-- the connection is busy until the rows are read
+	assert2 (false, pcall (CONN.execute, CONN, "select 1"))
+	assert2 (nil, cur:numrows ())
+	local n = 0
+	local a, b = cur:fetch ()
+	while a do
+		n = n + 1
+		assert2 (tostring (n), a)
+		assert2 ("r"..n, b)
+		a, b = cur:fetch ()
+	end
+	assert2 (10, n)
+	-- closing the cursor before its end releases the connection
+	cur = CUR_OK (CONN:executestream ("select g from generate_series(1, 1000) g"))
+	assert2 ("1", cur:fetch ())
+	cur:close ()
+	assert2 (0, CONN:executestream ("create temporary table stream_test (f integer)"))
+	assert2 (nil, (CONN:executestream ("select * from no_such_table")))
+	-- empty result
+	cur = CUR_OK (CONN:executestream ("select * from stream_test"))
+	assert2 (nil, cur:fetch ())
+	assert2 (0, CONN:execute ("drop table stream_test"))
+	io.write (" executestream")
+end)
+
+table.insert (EXTENSIONS, function ()
+	-- positional parameters
+	local cur = CUR_OK (CONN:execute ("select $1::text, $2::int4 + 1, $3::float8 * 2, $4::bool, $5::text is null",
+		"a'b", 41, 1.25, true, nil))
+	local a, b, c, d, e = cur:fetch ()
+	assert2 ("a'b", a)
+	assert2 ("42", b)
+	assert2 ("2.5", c)
+	assert2 ("t", d)
+	assert2 ("t", e)
+	cur:close ()
+	-- parameters in a table, with a hole
+	cur = CUR_OK (CONN:execute ("select $1::text, $2::text is null, $3::text", { "x", nil, "z", n = 3 }))
+	a, b, c = cur:fetch ()
+	assert2 ("x", a)
+	assert2 ("t", b)
+	assert2 ("z", c)
+	cur:close ()
+	-- binary strings are sent as bytea
+	cur = CUR_OK (CONN:execute ("select length($1), length($2)", "a\0b", luasql.blob ("\255\254")))
+	a, b = cur:fetch ()
+	assert2 ("3", a)
+	assert2 ("2", b)
+	cur:close ()
+	assert2 (false, pcall (CONN.execute, CONN, "select $1", {}, {}))
+	io.write (" parameters")
+end)
+
+table.insert (CONN_METHODS, "prepare")
+table.insert (EXTENSIONS, function ()
+	local stmt = assert (CONN:prepare ("select $1::int4 + $2, length($3::bytea)"))
+	local types = stmt:getparamtypes ()
+	assert2 ("int4", types[1])
+	assert2 ("int4", types[2])
+	assert2 ("bytea", types[3])
+	for i = 1, 3 do
+		local cur = CUR_OK (stmt:execute (i, 10, "a\\b"))
+		local sum, len = cur:fetch ()
+		assert2 (tostring (i + 10), sum)
+		-- bytea parameters receive strings as binary values
+		assert2 ("3", len)
+		cur:close ()
+	end
+	assert2 (false, pcall (stmt.execute, stmt, 1))
+	assert2 (true, stmt:close ())
+	assert2 (false, stmt:close ())
+	assert2 (false, pcall (stmt.execute, stmt, 1, 2, ""))
+	assert2 (nil, (CONN:prepare ("select * from no_such_table")))
+	io.write (" prepare")
+end)
+
+table.insert (CONN_METHODS, "pipeline")
+table.insert (EXTENSIONS, function ()
+	assert2 (0, CONN:execute ("create temporary table pipeline_test (f integer)"))
+	local stmt = assert (CONN:prepare ("select 1"))
+	local results, errors = CONN:pipeline (function (p)
+		for i = 1, 5 do
+			assert (p:execute ("insert into pipeline_test values ($1)", i))
+		end
+		-- the connection only runs statements through the pipeline
+		assert2 (false, pcall (CONN.execute, CONN, "select 1"))
+		local ok, err = CONN:close ()
+		assert2 (false, ok)
+		assert2 ("connection is in pipeline mode", err)
+		assert2 (false, stmt:close ())
+		assert (p:execute ("update pipeline_test set f = f + 1 where f > $1", 3))
+		assert (p:execute ("select count(*) from pipeline_test"))
+	end)
+	assert2 (nil, errors)
+	assert2 (7, #results)
+	for i = 1, 5 do
+		assert2 (1, results[i])
+	end
+	assert2 (2, results[6])
+	assert2 (true, stmt:close ())
+	assert2 ("5", results[7]:fetch ())
+	results[7]:close ()
+
+	-- statements after a failed one are skipped
+	local p = CONN:pipeline ()
+	assert (p:execute ("insert into pipeline_test values (1)"))
+	assert (p:execute ("insert into no_such_table values (1)"))
+	assert (p:execute ("insert into pipeline_test values (1)"))
+	results, errors = p:flush ()
+	assert2 (1, results[1])
+	assert2 (false, results[2])
+	assert2 (false, results[3])
+	assert2 ("string", type (errors[2]))
+	assert2 ("string", type (errors[3]))
+	assert2 (true, p:close ())
+
+	-- a pipeline closed by the function is not flushed
+	assert2 (nil, (CONN:pipeline (function (p) p:close () end)))
+	assert2 (0, CONN:execute ("drop table pipeline_test"))
+	io.write (" pipeline")
+end)
@@ -21,3 +21,35 @@ end
 
 table.insert (CONN_METHODS, "escape")
 table.insert (EXTENSIONS, escape)
+
+table.insert (EXTENSIONS, function ()
+	local conn = CONN_OK (ENV:connect (":memory:", { typed = true, vmcache = 2 }))
+	assert2 (0, conn:execute "create table typed (i integer, r real, n numeric, s varchar(10))")
+	for i = 1, 3 do
+		-- the vm of this statement is reused
+		assert2 (1, conn:execute "insert into typed values (1, 2.5, 'x', '3')")
+	end
+	local cur = CUR_OK (conn:execute "select * from typed")
+	local i, r, n, s = cur:fetch ()
+	assert2 ("number", type (i))
+	assert2 (1, i)
+	assert2 (2.5, r)
+	-- values that are not numbers are kept as strings
+	assert2 ("x", n)
+	assert2 ("3", s)
+	cur:close ()
+	-- a query run again reuses its vm
+	cur = CUR_OK (conn:execute "select count(*) from typed")
+	assert2 (3, cur:fetch ())
+	assert2 (nil, cur:fetch ())
+	cur = CUR_OK (conn:execute "select count(*) from typed")
+	assert2 (3, cur:fetch ())
+	cur:close ()
+	assert2 (true, conn:close ())
+
+	-- without options values are strings
+	local cur = CUR_OK (CONN:execute "select 1")
+	assert2 ("1", cur:fetch ())
+	cur:close ()
+	io.write (" typed")
+end)
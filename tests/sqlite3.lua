@@ -21,5 +21,916 @@ function finalization ()
 	os.execute ("rm -rf "..datasource)
 end
 
+---------------------------------------------------------------------
+-- Erases the test table, checking the number of removed rows.
+-- sqlite3_changes() is not reset by DDL statements, so a statement
+-- which changes no rows is run afterwards to keep the value returned
+-- by "drop table" at zero.
+-- @param n Number of rows expected to be removed.
+---------------------------------------------------------------------
+function erase_test_table (n)
+	assert2 (n, CONN:execute (sql_erase_table"t"))
+	assert2 (0, CONN:execute (sql_erase_table"t"))
+end
+
 table.insert (CONN_METHODS, "escape")
 table.insert (EXTENSIONS, escape)
+
+---------------------------------------------------------------------
+-- Test of prepared statements.
+---------------------------------------------------------------------
+table.insert (CONN_METHODS, "prepare")
+table.insert (EXTENSIONS, function ()
+	local ins = assert (CONN:prepare"insert into t (f1, f2) values (?, ?)")
+	assert2 (2, ins:getparamcount())
+	for i = 1, 10 do
+		assert2 (1, ins:execute("a"..i, i))
+	end
+	assert2 (1, ins:execute{ "b", 0 })
+	assert2 (false, CONN:close(), "connection closed with an open statement")
+	assert2 (true, ins:close())
+	assert2 (false, ins:close())
+	assert2 (false, pcall (ins.execute, ins, "c", 1))
+
+	local sel = assert (CONN:prepare"select f1 from t where f2 = :v")
+	for i = 1, 10 do
+		local cur = CUR_OK (sel:execute{ [":v"] = i })
+		assert2 ("a"..i, cur:fetch())
+		-- the statement can't be executed again while the cursor is open
+		assert2 (false, pcall (sel.execute, sel, { [":v"] = i }))
+		assert2 (false, sel:close())
+		assert2 (nil, cur:fetch())
+	end
+	local cur = CUR_OK (sel:execute{ [":v"] = 0 })
+	assert2 ("b", cur:fetch())
+	assert2 (true, cur:close())
+	-- bindings of a previous execution are cleared
+	cur = CUR_OK (sel:execute())
+	assert2 (nil, cur:fetch())
+	assert2 (true, sel:reset())
+	assert2 (true, sel:close())
+
+	-- the text must hold exactly one statement
+	assert2 (nil, (CONN:prepare"-- only a comment"))
+	assert2 (nil, (CONN:prepare"  ;  "))
+	assert2 (nil, (CONN:prepare"select 1; delete from t"))
+	sel = assert (CONN:prepare"select 1; -- trailing comment\n ;")
+	assert2 (true, sel:close())
+
+	erase_test_table (11)
+	io.write (" prepare")
+end)
+
+---------------------------------------------------------------------
+-- Test of the statement cache.
+---------------------------------------------------------------------
+table.insert (CONN_METHODS, "setstmtcache")
+table.insert (CONN_METHODS, "getstmtcachestats")
+table.insert (EXTENSIONS, function ()
+	local stats = CONN:getstmtcachestats()
+	assert2 (0, stats.size)
+	assert2 (0, stats.hits)
+
+	assert2 (true, CONN:setstmtcache(2))
+	for i = 1, 5 do
+		assert2 (1, CONN:execute("insert into t (f1, f2) values (?, ?)", "a"..i, i))
+	end
+	stats = CONN:getstmtcachestats()
+	assert2 (1, stats.misses)
+	assert2 (4, stats.hits)
+	assert2 (1, stats.used)
+
+	-- the same SQL text may be in use by two cursors at the same time
+	local sql = "select f1 from t where f2 = ?"
+	local cur1 = CUR_OK (CONN:execute(sql, 1))
+	local cur2 = CUR_OK (CONN:execute(sql, 2))
+	assert2 ("a1", cur1:fetch())
+	assert2 ("a2", cur2:fetch())
+	assert2 (nil, cur1:fetch())
+	assert2 (true, cur2:close())
+	-- parameters bound by a previous execution are cleared
+	local cur = CUR_OK (CONN:execute(sql, { [1] = 3 }))
+	assert2 ("a3", cur:fetch())
+	cur:close()
+
+	stats = CONN:getstmtcachestats()
+	assert2 (2, stats.used)
+	assert2 (0, stats.evictions)
+	assert2 (1, CONN:execute("delete from t where f2 = ?", 5))
+	stats = CONN:getstmtcachestats()
+	assert2 (2, stats.used)
+	assert2 (1, stats.evictions)
+
+	-- only texts holding a single statement are cached, keyed by the whole text
+	cur = CUR_OK (CONN:execute("select f1 from t where f2 = 1; select 2"))
+	assert2 ("a1", cur:fetch())
+	cur:close()
+	cur = CUR_OK (CONN:execute("select f1 from t where f2 = 1;"))
+	assert2 ("a1", cur:fetch())
+	cur:close()
+	stats = CONN:getstmtcachestats()
+	assert2 (5, stats.hits)
+	assert2 (2, stats.used)
+
+	-- a binding error gives the cached vm back
+	assert2 (false, pcall (CONN.execute, CONN, "select f1 from t where f2 = 1;", 1))
+	assert2 (false, pcall (CONN.execute, CONN, "select f1 from t where f2 = ?", print))
+	cur = CUR_OK (CONN:execute("select f1 from t where f2 = 1;"))
+	assert2 ("a1", cur:fetch())
+	cur:close()
+	stats = CONN:getstmtcachestats()
+	assert2 (7, stats.hits)
+	assert2 (2, stats.used)
+
+	assert2 (true, CONN:setstmtcache(0))
+	assert2 (0, CONN:getstmtcachestats().used)
+	erase_test_table (4)
+	io.write (" stmtcache")
+end)
+
+---------------------------------------------------------------------
+-- Test of bulk execution.
+---------------------------------------------------------------------
+table.insert (CONN_METHODS, "executemany")
+table.insert (EXTENSIONS, function ()
+	local rows = {}
+	for i = 1, 100 do
+		rows[i] = { "a"..i, i }
+	end
+	assert2 (100, CONN:executemany("insert into t (f1, f2) values (?, ?)", rows))
+	assert2 (2, CONN:executemany("insert into t (f1, f2) values (:f1, :f2)",
+		{ { [":f1"] = "x", [":f2"] = 1 }, { [":f1"] = "y", [":f2"] = 2 } }, true))
+	assert2 (4, CONN:executemany("update t set f3 = ? where f2 = ?", { { "z", 1 }, { "z", 2 } }))
+	assert2 (0, CONN:executemany("insert into t (f1) values (?)", {}))
+	assert2 (nil, (CONN:executemany("-- only a comment", { {} }, true)))
+
+	-- a failing row rolls back the whole transaction
+	CONN:execute"create table u (f1 integer unique)"
+	local n, err = CONN:executemany("insert into u values (?)", { { 1 }, { 2 }, { 1 } }, true)
+	assert2 (nil, n)
+	assert (err:find"row 3", err)
+	local cur = CUR_OK (CONN:execute"select count(*) from u")
+	assert2 (0, tonumber (cur:fetch()))
+	cur:close()
+	-- so do an invalid row and an invalid parameter
+	n, err = CONN:executemany("insert into u values (?)", { { 1 }, 2 }, true)
+	assert2 (nil, n)
+	assert (err:find"row 2 is not a table", err)
+	n, err = CONN:executemany("insert into u values (:v)", { { [":v"] = 1 }, { [":w"] = 2 } }, true)
+	assert2 (nil, n)
+	assert (err:find"row 2", err)
+	cur = CUR_OK (CONN:execute"select count(*) from u")
+	assert2 (0, tonumber (cur:fetch()))
+	cur:close()
+	CONN:execute"drop table u"
+
+	erase_test_table (102)
+	io.write (" executemany")
+end)
+
+---------------------------------------------------------------------
+-- Test of batch fetching.
+---------------------------------------------------------------------
+table.insert (CUR_METHODS, "fetchmany")
+table.insert (CUR_METHODS, "fetchall")
+table.insert (EXTENSIONS, function ()
+	local rows = {}
+	for i = 1, 10 do
+		rows[i] = { "a"..i, i }
+	end
+	assert2 (10, CONN:executemany("insert into t (f1, f2) values (?, ?)", rows))
+
+	local cur = CUR_OK (CONN:execute"select f1, f2 from t order by rowid")
+	local batch = cur:fetchmany(4)
+	assert2 (4, #batch)
+	assert2 ("a1", batch[1][1])
+	assert2 ("4", batch[4][2])
+	batch = cur:fetchmany(4, "a")
+	assert2 (4, #batch)
+	assert2 ("a5", batch[1].f1)
+	assert2 (nil, batch[1][1])
+	batch = cur:fetchmany(4, "na")
+	assert2 (2, #batch)
+	assert2 ("a10", batch[2][1])
+	assert2 ("a10", batch[2].f1)
+	-- the exhausted cursor is closed by the next call
+	assert2 (nil, cur:fetchmany(4))
+	assert2 (false, cur:close(), MSG_CURSOR_NOT_CLOSED)
+
+	cur = CUR_OK (CONN:execute"select f1 from t order by rowid")
+	assert2 ("a1", cur:fetch())
+	batch = cur:fetchall()
+	assert2 (9, #batch)
+	assert2 ("a10", batch[9][1])
+	assert2 (nil, cur:fetch())
+	assert2 (false, cur:close(), MSG_CURSOR_NOT_CLOSED)
+
+	-- an empty result
+	cur = CUR_OK (CONN:execute"select f1 from t where 0")
+	assert2 (nil, cur:fetchall())
+	assert2 (false, cur:close(), MSG_CURSOR_NOT_CLOSED)
+	cur = CUR_OK (CONN:execute"select f1 from t where 0")
+	assert2 (nil, cur:fetch({}))
+	assert2 (false, cur:close(), MSG_CURSOR_NOT_CLOSED)
+
+	erase_test_table (10)
+	io.write (" fetchmany")
+end)
+
+---------------------------------------------------------------------
+-- Test of columnar fetching.
+---------------------------------------------------------------------
+table.insert (CUR_METHODS, "fetchcolumns")
+table.insert (EXTENSIONS, function ()
+	local rows = {}
+	for i = 1, 10 do
+		rows[i] = { "a"..i, i }
+	end
+	rows[5][1] = nil
+	assert2 (10, CONN:executemany("insert into t (f1, f2) values (?2, ?1)", rows))
+
+	local cur = CUR_OK (CONN:execute"select f2, f1 from t order by rowid")
+	local cols, n = cur:fetchcolumns(4)
+	assert2 (4, n)
+	assert2 (2, #cols)
+	assert2 ("a1", cols[1][1])
+	assert2 ("a4", cols[1][4])
+	assert2 ("4", cols[2][4])
+	cols, n = cur:fetchcolumns()
+	assert2 (6, n)
+	assert2 (nil, cols[1][1])
+	assert2 ("a10", cols[1][6])
+	assert2 ("10", cols[2][6])
+	assert2 (nil, cur:fetchcolumns())
+	assert2 (false, cur:close(), MSG_CURSOR_NOT_CLOSED)
+
+	erase_test_table (10)
+	io.write (" fetchcolumns")
+end)
+
+---------------------------------------------------------------------
+-- Test of the connection options table.
+---------------------------------------------------------------------
+table.insert (EXTENSIONS, function ()
+	local function pragma (conn, name)
+		local cur = CUR_OK (conn:execute ("pragma "..name))
+		local value = cur:fetch()
+		cur:close()
+		return value
+	end
+	local path = datasource.."-options"
+	local conn = CONN_OK (ENV:connect (path, {
+		timeout = 1000,
+		nomutex = true,
+		page_size = 8192,
+		journal_mode = "wal",
+		synchronous = "normal",
+		cache_size = -4000,
+		temp_store = "memory",
+	}))
+	assert2 ("wal", pragma (conn, "journal_mode"))
+	assert2 (8192, tonumber (pragma (conn, "page_size")))
+	assert2 (1, tonumber (pragma (conn, "synchronous")))
+	assert2 (-4000, tonumber (pragma (conn, "cache_size")))
+	assert2 (2, tonumber (pragma (conn, "temp_store")))
+	assert2 (true, conn:close())
+
+	-- booleans are taken as 1 and 0; other values are refused
+	conn = CONN_OK (ENV:connect (path, { synchronous = false }))
+	assert2 (0, tonumber (pragma (conn, "synchronous")))
+	assert2 (true, conn:close())
+	local ok, err = ENV:connect (path, { synchronous = {} })
+	assert2 (nil, ok)
+	assert (err:find"synchronous", err)
+
+	conn = CONN_OK (ENV:connect (path, { readonly = true }))
+	assert2 (nil, conn:execute "create table x (c char)")
+	assert2 (true, conn:close())
+
+	os.remove (path)
+	os.remove (path.."-wal")
+	os.remove (path.."-shm")
+	io.write (" options")
+end)
+
+---------------------------------------------------------------------
+-- Test of incremental blob I/O.
+---------------------------------------------------------------------
+table.insert (CONN_METHODS, "openblob")
+table.insert (EXTENSIONS, function ()
+	assert (CONN:execute"create table b (data blob)")
+	assert2 (1, CONN:execute("insert into b values (zeroblob(?))", 10000))
+	local rowid = CONN:getlastautoid()
+	assert2 (1, CONN:execute("insert into b values (?)", "short"))
+
+	local blob = assert (CONN:openblob("main", "b", "data", rowid, true))
+	assert2 (10000, blob:size())
+	assert2 (false, CONN:close(), "connection closed with an open blob")
+	assert2 (true, blob:write(0, "head"))
+	assert2 (true, blob:write(9996, "tail"))
+	assert2 (nil, blob:write(9999, "too long"))
+	assert2 ("head", blob:read(0, 4))
+	assert2 ("\0\0", blob:read(4, 2))
+	assert2 ("tail", blob:read(9996, 100))
+	assert2 ("", blob:read(10000, 100))
+	-- stream the blob in chunks
+	local chunks, offset = {}, 0
+	repeat
+		local chunk = blob:read(offset, 4096)
+		offset = offset + #chunk
+		chunks[#chunks+1] = chunk
+	until chunk == ""
+	assert2 (10000, #table.concat(chunks))
+
+	assert2 (true, blob:reopen(rowid + 1))
+	assert2 ("short", blob:read(0, 100))
+	assert2 (true, blob:close())
+	assert2 (false, blob:close())
+	assert2 (false, pcall (blob.read, blob, 0, 1))
+
+	blob = assert (CONN:openblob("main", "b", "data", rowid, false))
+	assert2 (nil, blob:write(0, "x"))
+	blob:close()
+	assert2 (nil, CONN:openblob("main", "b", "data", rowid + 10, false))
+
+	local cur = CUR_OK (CONN:execute("select substr(data, 1, 4), length(data) from b where rowid = ?", rowid))
+	local head, len = cur:fetch()
+	assert2 ("head", head)
+	assert2 (10000, len)
+	cur:close()
+	assert (CONN:execute"drop table b")
+	erase_test_table (0)
+	io.write (" openblob")
+end)
+
+---------------------------------------------------------------------
+-- Test of online backups and database images.
+---------------------------------------------------------------------
+table.insert (CONN_METHODS, "backup")
+table.insert (EXTENSIONS, function ()
+	local function count (conn)
+		local cur = CUR_OK (conn:execute"select count(*), sum(length(v)) from s")
+		local n, len = cur:fetch()
+		cur:close()
+		return tonumber (n), tonumber (len)
+	end
+	local mem = CONN_OK (ENV:connect":memory:")
+	assert (mem:execute"create table s (v text)")
+	local rows = {}
+	for i = 1, 500 do
+		rows[i] = { string.rep("x", 1000) }
+	end
+	assert2 (500, mem:executemany("insert into s values (?)", rows, true))
+
+	-- copy to a file, a few pages at a time
+	local path = datasource.."-backup"
+	local bk = assert (mem:backup(path, 10))
+	assert2 (false, mem:close(), "connection closed with an open backup")
+	local done, remaining, total = bk:step()
+	assert2 (false, done)
+	assert (remaining > 0 and remaining < total)
+	repeat
+		done = bk:step()
+	until done
+	assert2 (false, bk:close())
+	local file = CONN_OK (ENV:connect (path))
+	assert2 (500, count (file))
+
+	-- copy to another connection, all at once
+	local mem2 = CONN_OK (ENV:connect":memory:")
+	bk = assert (file:backup(mem2))
+	assert2 (false, mem2:close(), "connection closed with an open backup")
+	assert2 (true, bk:step())
+	assert2 (500, count (mem2))
+	assert2 (true, mem2:close())
+	assert2 (true, file:close())
+	os.remove (path)
+
+	if mem.serialize then
+		local image = assert (mem:serialize())
+		local copy = CONN_OK (ENV:connect":memory:")
+		assert2 (true, copy:deserialize(image))
+		local n, len = count (copy)
+		assert2 (500, n)
+		assert2 (500000, len)
+		-- the image may grow
+		assert2 (1, copy:execute("insert into s values ('y')"))
+		assert2 (501, count (copy))
+		assert2 (true, copy:close())
+		-- images are only checked when they are used
+		copy = CONN_OK (ENV:connect":memory:")
+		assert2 (true, copy:deserialize(string.rep("not a database", 100)))
+		assert2 (nil, copy:execute"select * from s")
+		assert2 (true, copy:close())
+	end
+	assert2 (true, mem:close())
+	io.write (" backup")
+end)
+
+table.insert (CONN_METHODS, "createfunction")
+table.insert (CONN_METHODS, "createaggregate")
+table.insert (EXTENSIONS, function ()
+	local function value (sql)
+		local cur = CUR_OK (CONN:execute (sql))
+		local v = cur:fetch()
+		cur:close()
+		return v
+	end
+	assert2 (true, CONN:createfunction("twice", 1, function (x)
+		return x * 2
+	end, "d"))
+	assert2 (42, tonumber (value"select twice(21)"))
+	assert2 (true, CONN:createfunction("describe", -1, function (...)
+		local t = {}
+		for i = 1, select ("#", ...) do
+			t[i] = type ((select (i, ...)))
+		end
+		return table.concat (t, ",")
+	end))
+	assert2 ("number,string,nil,string", value"select describe(1, 'a', null, x'00')")
+	assert2 ("", value"select describe()")
+	assert2 (true, CONN:createfunction("fail", 0, function ()
+		error ("failed on purpose", 0)
+	end))
+	local ok, err = CONN:execute"select fail()"
+	assert2 (nil, ok)
+	assert (err:find ("failed on purpose", 1, true))
+
+	-- aggregate
+	assert2 (true, CONN:createaggregate("joined", 1, function (s, v)
+		return s and s..","..v or v
+	end, function (s)
+		return s or "empty"
+	end))
+	assert2 (4, CONN:executemany("insert into t (f1) values (?)",
+		{ {"a"}, {"b"}, {"c"}, {"d"} }))
+	assert2 ("a,b,c,d", value"select joined(f1) from (select f1 from t order by f1)")
+	assert2 ("empty", value"select joined(f1) from t where f1 = 'none'")
+	erase_test_table (4)
+	-- redefining a function releases the previous one
+	assert2 (true, CONN:createfunction("twice", 1, function (x)
+		return x..x
+	end))
+	assert2 ("abab", value"select twice('ab')")
+	io.write (" createfunction")
+end)
+
+table.insert (CONN_METHODS, "setprofile")
+table.insert (CONN_METHODS, "getprofile")
+table.insert (EXTENSIONS, function ()
+	if not CONN.setprofile then
+		return
+	end
+	assert2 (true, CONN:setprofile(2))
+	assert2 (1, CONN:execute"insert into t (f1) values ('a')")
+	assert2 (1, CONN:execute"insert into t (f1) values ('b')")
+	local cur = CUR_OK (CONN:execute"select f1 from t order by f1")
+	assert2 ("a", cur:fetch())
+	assert2 ("b", cur:fetch())
+	assert2 (nil, cur:fetch())
+	-- the buffer keeps the last records
+	local records = CONN:getprofile()
+	assert2 (2, #records)
+	assert2 ("insert into t (f1) values ('b')", records[1].sql)
+	assert2 ("select f1 from t order by f1", records[2].sql)
+	assert (records[2].time >= 0)
+	assert2 (1, records[2].fullscan_step)
+	assert2 (1, records[2].sort)
+	assert (records[2].vm_step > 0)
+	assert2 (0, #CONN:getprofile())
+
+	-- parameters are expanded
+	local seen = {}
+	assert2 (true, CONN:setprofile(function (record)
+		seen[#seen+1] = record
+	end))
+	assert2 (2, CONN:execute("delete from t where f1 in (?, ?)", "a", "b"))
+	assert2 (1, #seen)
+	assert2 ("delete from t where f1 in ('a', 'b')", seen[1].sql)
+	assert2 (true, CONN:setprofile())
+	erase_test_table (0)
+	assert2 (1, #seen)
+	io.write (" profile")
+end)
+
+table.insert (CONN_METHODS, "setbudget")
+table.insert (CONN_METHODS, "interrupt")
+table.insert (EXTENSIONS, function ()
+	local endless = [[with recursive c(x) as (select 1 union all select x+1 from c)
+		select count(*) from c]]
+	local ok, err
+
+	assert2 (true, CONN:setbudget(nil, 100000))
+	ok, err = CONN:execute(endless)
+	assert2 (nil, ok)
+	assert2 ("LuaSQL: step budget exceeded", err)
+	-- the budget applies to each call
+	local cur = CUR_OK (CONN:execute"with recursive c(x) as (select 1 union all select x+1 from c) select x from c")
+	for i = 1, 3 do
+		assert2 (1000, #cur:fetchmany(1000))
+	end
+	ok, err = cur:fetchall()
+	assert2 (nil, ok)
+	assert2 ("LuaSQL: step budget exceeded", err)
+	assert2 (false, pcall (cur.fetch, cur))
+
+	-- an exceeded budget does not interrupt calls which are not limited
+	assert2 (true, CONN:setbudget(nil, 1))
+	ok, err = CONN:execute(endless)
+	assert2 ("LuaSQL: step budget exceeded", err)
+	assert2 (true, CONN:setautocommit(false))
+	assert2 (true, CONN:commit())
+	assert2 (true, CONN:rollback())
+	assert2 (true, CONN:setautocommit(true))
+
+	assert2 (true, CONN:setbudget(0.05))
+	ok, err = CONN:execute(endless)
+	assert2 (nil, ok)
+	assert2 ("LuaSQL: time budget exceeded", err)
+	assert2 (true, CONN:setbudget())
+
+	-- interruption from an SQL function
+	assert2 (true, CONN:createfunction("stop_at", 2, function (x, limit)
+		if x >= limit then
+			CONN:interrupt()
+		end
+		return x
+	end))
+	ok, err = CONN:execute("with recursive c(x) as (select 1 union all select stop_at(x+1, 10) from c) select count(*) from c")
+	assert2 (nil, ok)
+	assert (err:find"interrupt")
+	cur = CUR_OK (CONN:execute"select count(*) from t")
+	assert2 (0, tonumber (cur:fetch()))
+	cur:close()
+	io.write (" budget")
+end)
+
+table.insert (CONN_METHODS, "exec_script")
+table.insert (EXTENSIONS, function ()
+	local lines = {
+		"-- seed data",
+		"create table script (n integer);",
+		"select 1;",
+	}
+	for i = 1, 100 do
+		lines[#lines+1] = string.format ("insert into script values (%d);", i)
+	end
+	lines[#lines+1] = "update script set n = n * 2 where n <= 10;"
+	lines[#lines+1] = "/* done */"
+	assert2 (110, CONN:exec_script(table.concat (lines, "\n")))
+	local cur = CUR_OK (CONN:execute"select count(*), sum(n) from script")
+	local count, sum = cur:fetch()
+	cur:close()
+	assert2 (100, tonumber (count))
+	assert2 (5050 + 55, tonumber (sum))
+	assert2 (0, CONN:exec_script"")
+	assert2 (0, CONN:exec_script"  -- nothing\n")
+
+	-- stops at the first error, keeping the previous changes
+	local script = "insert into script values (101);\n  insert into nowhere values (1);\ninsert into script values (102);"
+	local ok, err, pos = CONN:exec_script(script)
+	assert2 (nil, ok)
+	assert (err:find"nowhere")
+	assert2 (script:find"insert into nowhere", pos)
+	cur = CUR_OK (CONN:execute"select max(n) from script")
+	assert2 (101, tonumber (cur:fetch()))
+	cur:close()
+	assert (CONN:execute"drop table script")
+	erase_test_table (0)
+	io.write (" exec_script")
+end)
+
+table.insert (EXTENSIONS, function ()
+	local function value (sql, ...)
+		local cur = CUR_OK (CONN:execute (sql, ...))
+		local v = cur:fetch()
+		cur:close()
+		return v
+	end
+	-- blob values
+	local bytes = "a\0b\255"
+	local blob = luasql.blob (bytes)
+	assert2 ("userdata", type (blob))
+	assert2 ("blob", value ("select typeof(?)", blob))
+	assert2 ("text", value ("select typeof(?)", bytes))
+	assert2 (bytes, value ("select ?", blob))
+	assert2 ("blob", value ("select typeof(:b)", { [":b"] = blob }))
+	assert2 (false, pcall (CONN.execute, CONN, "select ?, ?", 1, {}))
+	assert2 (1, tonumber (value ("select ?", true)))
+	assert2 (0, tonumber (value ("select ?", false)))
+
+	-- values bound without copy are not kept after the call
+	assert2 (1, CONN:execute ("insert into t (f1, f2) values (?, ?)",
+		string.rep ("z", 3).."1", blob))
+	collectgarbage ()
+	local cur = CUR_OK (CONN:execute"select f1, typeof(f2), length(f2) from t")
+	local f1, f2type, f2len = cur:fetch()
+	cur:close()
+	assert2 ("zzz1", f1)
+	assert2 ("blob", f2type)
+	assert2 (4, tonumber (f2len))
+	-- queries copy their parameters, since they outlive the call
+	cur = CUR_OK (CONN:execute ("select f1 from t where f1 = ? or ? = 'x'",
+		string.rep ("z", 3).."1", "y"))
+	collectgarbage ()
+	assert2 ("zzz1", cur:fetch())
+	cur:close()
+	erase_test_table (1)
+	io.write (" blob")
+end)
+
+table.insert (EXTENSIONS, function ()
+	if not luasql.sharedcaches then
+		return
+	end
+	local path = datasource.."-shared"
+	local env1 = ENV_OK (luasql.sqlite3 ())
+	local env2 = ENV_OK (luasql.sqlite3 ())
+	local conn1 = CONN_OK (env1:connect (path, { shared = true }))
+	local conn2 = CONN_OK (env2:connect (path, { shared = true }))
+	-- an environment counts once
+	local conn3 = CONN_OK (env2:connect (path, { shared = true }))
+	assert2 (2, luasql.sharedcaches()[path])
+
+	assert (conn1:execute"create table s (v integer)")
+	assert2 (1, conn1:execute"insert into s values (42)")
+	local cur = CUR_OK (conn2:execute"select v from s")
+	assert2 (42, tonumber (cur:fetch()))
+	cur:close()
+	assert2 (true, conn1:close())
+	assert2 (true, env1:close())
+	assert2 (1, luasql.sharedcaches()[path])
+	assert2 (true, conn3:close())
+	assert2 (true, conn2:close())
+	assert2 (true, env2:close())
+	assert2 (nil, luasql.sharedcaches()[path])
+	os.remove (path)
+	io.write (" shared")
+end)
+
+table.insert (CONN_METHODS, "executeasync")
+table.insert (EXTENSIONS, function ()
+	if not CONN.executeasync then
+		return
+	end
+	-- Lua functions cannot be called from the worker thread
+	local ok, err = CONN:executeasync ("select 1")
+	assert2 (nil, ok)
+	assert (err:find"Lua functions")
+
+	local conn = CONN_OK (ENV:connect (datasource))
+	-- but once the last one is removed, queries can run again
+	assert2 (true, conn:setprofile (function () end))
+	assert2 (nil, (conn:executeasync ("select 1")))
+	assert2 (true, conn:setprofile ())
+	assert2 (1, tonumber (assert (conn:executeasync ("select 1")):result()[1][1]))
+	assert2 (1, CONN:execute ("insert into t (f1, f2) values ('a', 1)"))
+	assert2 (1, CONN:execute ("insert into t (f1, f2) values ('b', 2)"))
+	local async = assert (conn:executeasync ("select f1, f2 from t where f2 >= ? order by f1", 1))
+	assert2 ("number", type (async:getfd()))
+	-- the connection waits for the result
+	assert2 (false, pcall (conn.execute, conn, "select 1"))
+	assert2 (false, conn:close())
+	while not async:ready() do end
+	local rows, names = async:result()
+	assert2 (2, #rows)
+	assert2 ("a", rows[1][1])
+	assert2 (2, tonumber (rows[2][2]))
+	assert2 ("f1", names[1])
+	assert2 ("f2", names[2])
+	assert2 (false, pcall (async.result, async))
+
+	async = assert (conn:executeasync ("delete from t where f1 = ?", "a"))
+	assert2 (1, async:result())
+	-- compilation errors are reported at once, others by the result
+	ok, err = conn:executeasync ("select * from nowhere")
+	assert2 (nil, ok)
+	assert (err:find"nowhere")
+	async = assert (conn:executeasync ("select abs(-9223372036854775807 - 1)"))
+	ok, err = async:result()
+	assert2 (nil, ok)
+	assert (err:find"overflow")
+
+	-- objects of the connection cannot be closed meanwhile
+	local cur = CUR_OK (conn:execute ("select f1 from t"))
+	local stmt = assert (conn:prepare ("select f1 from t"))
+	async = assert (conn:executeasync ("select 1"))
+	assert2 (false, cur:close())
+	assert2 (false, stmt:close())
+	assert2 (1, tonumber (async:result()[1][1]))
+	assert2 (true, cur:close())
+	-- but they can be collected
+	async = assert (conn:executeasync ("select 1"))
+	stmt = nil
+	collectgarbage ()
+	assert2 (true, async:close())
+
+	-- a running query is interrupted on close
+	async = assert (conn:executeasync [[with recursive c(x) as (select 1 union all select x+1 from c)
+		select count(*) from c]])
+	assert2 (true, async:close())
+	assert2 (false, (async:close()))
+	assert2 (true, conn:close())
+	erase_test_table (1)
+	io.write (" async")
+end)
+
+table.insert (CUR_METHODS, "rows")
+table.insert (EXTENSIONS, function ()
+	assert2 (3, CONN:executemany("insert into t (f1, f2) values (?, ?)",
+		{ {"a", 1}, {"b", nil}, {"c", 3} }))
+	local cur = CUR_OK (CONN:execute"select f1, f2 from t order by f1")
+	local seen, last = {}
+	for row in cur:rows"an" do
+		assert (last == nil or last == row, "the row table is reused")
+		last = row
+		assert2 (row[1], row.f1)
+		seen[#seen+1] = row.f1..":"..tostring (row[2])
+	end
+	assert2 ("a:1,b:nil,c:3", table.concat (seen, ","))
+	-- closed at the end
+	assert2 (false, pcall (cur.fetch, cur))
+
+	cur = CUR_OK (CONN:execute"select f1 from t order by f1")
+	local n = 0
+	for row in cur:rows() do
+		n = n + 1
+		assert2 (nil, row.f1)
+		break
+	end
+	assert2 (1, n)
+	cur:close()
+
+	-- empty results
+	cur = CUR_OK (CONN:execute"select f1 from t where 0")
+	for row in cur:rows() do
+		error"no rows expected"
+	end
+	-- errors are raised
+	cur = CUR_OK (CONN:execute"select f1, abs(-9223372036854775807 - (f1 = 'b')) from t")
+	assert2 (false, pcall (function ()
+		for row in cur:rows() do end
+	end))
+	erase_test_table (3)
+	io.write (" rows")
+end)
+
+table.insert (CONN_METHODS, "createmodule")
+table.insert (EXTENSIONS, function ()
+	if not CONN.createmodule then
+		return
+	end
+	local function values (sql)
+		local list = {}
+		local cur = CUR_OK (CONN:execute (sql))
+		local row = cur:fetch ({})
+		while row do
+			list[#list+1] = table.concat (row, ":")
+			row = cur:fetch (row)
+		end
+		cur:close()
+		return table.concat (list, ",")
+	end
+
+	-- columnar data, with lookups on "id"
+	local ids, names = {}, {}
+	for i = 1, 1000 do
+		ids[i] = i % 100
+		names[i] = "n"..i
+	end
+	assert2 (true, CONN:createmodule ("lua_people", {
+		columns = { "id", "name" },
+		data = { id = ids, name = names },
+		index = "id",
+	}))
+	assert2 ("1000", values"select count(*) from lua_people")
+	assert2 ("7:n7,7:n107", values"select id, name from lua_people where id = 7 and rowid < 200 order by rowid")
+	assert2 ("", values"select name from lua_people where id = 'x'")
+	assert2 ("", values"select name from lua_people where id = null")
+	assert2 ("10", values"select count(*) from lua_people where id = 7")
+	-- another collation is not handled by the lookups
+	assert2 ("10", values"select count(*) from lua_people where id = 7 collate nocase")
+	-- used in place
+	names[7] = "seven"
+	assert2 ("seven", values"select name from lua_people where rowid = 7")
+	-- lookups see changes of the indexed column too
+	ids[7] = 1007
+	assert2 ("seven", values"select name from lua_people where id = 1007")
+	assert2 ("9", values"select count(*) from lua_people where id = 7")
+	ids[7] = 7
+	-- booleans are found by the integers SQLite sees, and the rows found
+	-- are checked again by SQLite
+	assert2 (true, CONN:createmodule ("lua_flags", {
+		columns = { "flag" },
+		data = { flag = { true, false, "ab", 1, 0/0 } },
+		index = "flag",
+	}))
+	assert2 ("1,1", values"select flag from lua_flags where flag = 1")
+	assert2 ("0", values"select flag from lua_flags where flag = 0")
+	assert2 ("ab", values"select flag from lua_flags where flag = 'ab'")
+	assert2 ("", values"select flag from lua_flags where flag = x'6162'")
+	-- join with a real table
+	assert2 (2, CONN:executemany ("insert into t (f1, f2) values (?, ?)",
+		{ { "a", 5 }, { "b", 250 } }))
+	assert2 ("a:n5,a:n105", values"select f1, name from t join lua_people on id = cast(f2 as integer) where lua_people.rowid < 200 order by f1, lua_people.rowid")
+
+	-- rows function
+	local calls = {}
+	assert2 (true, CONN:createmodule ("lua_pairs", {
+		columns = { "k", "v" },
+		index = "k",
+		rows = function (column, value)
+			calls[#calls+1] = column and column.."="..tostring (value) or "all"
+			local i = 0
+			return function ()
+				i = i + 1
+				if i <= 3 then
+					return { i, i * i }
+				end
+			end
+		end,
+	}))
+	assert2 ("1:1,2:4,3:9", values"select k, v from lua_pairs")
+	-- the rows function may ignore the constraint
+	assert2 ("2:4", values"select k, v from lua_pairs where k = 2")
+	assert2 ("all,k=2", table.concat (calls, ","))
+
+	-- errors
+	assert2 (true, CONN:createmodule ("lua_broken", {
+		columns = { "x" },
+		rows = function () error ("no rows today", 0) end,
+	}))
+	local ok, err = CONN:execute"select * from lua_broken"
+	assert2 (nil, ok)
+	assert (err:find"no rows today")
+	assert2 (false, pcall (CONN.createmodule, CONN, "lua_bad", { columns = {} }))
+	assert2 (false, pcall (CONN.createmodule, CONN, "lua_bad", { columns = { "a" }, data = {} }))
+	assert2 (nil, (CONN:createmodule ("lua_bad", { columns = { "a" }, data = { a = {} }, index = "b" })))
+	erase_test_table (2)
+	io.write (" createmodule")
+end)
+
+table.insert (CONN_METHODS, "stats")
+table.insert (EXTENSIONS, function ()
+	local stats = CONN:stats()
+	assert2 ("table", type (stats))
+	assert (stats.cache_used > 0)
+	assert (stats.schema_used > 0)
+	assert2 ("number", type (stats.lookaside_used_highwater))
+	if stats.cache_hit then
+		local cur = CUR_OK (CONN:execute"select count(*) from t")
+		cur:fetch()
+		cur:close()
+		local after = CONN:stats(true)
+		assert (after.cache_hit + after.cache_miss > stats.cache_hit + stats.cache_miss)
+		-- the counters were reset
+		assert2 (0, CONN:stats().cache_hit)
+	end
+
+	local mem = luasql.memstats()
+	assert (mem.memory_used > 0)
+	assert (mem.memory_used_highwater >= mem.memory_used)
+	assert2 ("number", type (mem.malloc_size))
+	luasql.memstats(true)
+	assert (luasql.memstats().memory_used_highwater <= mem.memory_used_highwater)
+	io.write (" stats")
+end)
+
+table.insert (EXTENSIONS, function ()
+	-- with the schema lock, the first row fixes the column accessors;
+	-- later values of other storage classes are converted by SQLite to
+	-- the class of the first row, while NULL stays nil
+	local conn = CONN_OK (ENV:connect (datasource, { schemalock = true }))
+	local cur = CUR_OK (conn:execute [[
+		select 1, 'a', 1.5, null, x'00ff' union all
+		select 'b', 2, x'00ff', 3, x'' union all
+		select null, 2.5, 'c', 'd', null union all
+		select 0, '', 0.0, null, 'e']])
+	local a, b, c, d, e = cur:fetch()
+	assert2 (1, a)
+	assert2 ("a", b)
+	assert2 (1.5, c)
+	assert2 (nil, d)
+	assert2 ("\0\255", e)
+	local row = cur:fetch ({}, "a")
+	assert2 (0, row["1"])
+	assert2 ("2", row["'a'"])
+	assert2 (0, row["1.5"])
+	assert2 (3, row["null"])
+	assert2 ("", row["x'00ff'"])
+	row = cur:fetch ({}, "n")
+	assert2 (nil, row[1])
+	assert2 ("2.5", row[2])
+	assert2 (0, row[3])
+	assert2 ("d", row[4])
+	assert2 (nil, row[5])
+	a, b, c, d, e = cur:fetch ()
+	assert2 (0, a)
+	assert2 ("", b)
+	assert2 (0, c)
+	assert2 (nil, d)
+	assert2 ("e", e)
+	assert2 (nil, cur:fetch ())
+	assert2 (true, conn:close ())
+	io.write (" schemalock")
+end)